@@ -0,0 +1,169 @@
+// Scenarios driving a Database into the states we fear most, on a virtual
+// clock so that they take seconds rather than hours:
+//
+//   expiry_storm    Reservations made within the same second all time out
+//                   at once. Measures the worst single request served
+//                   right after they did.
+//   memory_growth   Reservations pile up (half of them collected, so that
+//                   they are never removed). Measures the RSS per
+//                   reservation at every step.
+//
+// Every scenario prints its measurements and PASS or FAIL against its
+// threshold; the exit status is 1 if any of them failed. Build with:
+//
+//   g++ -std=c++20 -O2 -Isrc -o scenarios bench/scenarios.cpp
+//       src/database.cpp src/perfect_hash.cpp src/ticket_cipher.cpp
+//       src/trigram_index.cpp
+
+#include "clock.h"
+#include "database.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib> // std::size_t
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+
+///////////////////////////
+///                     ///
+///      CONSTANTS      ///
+///                     ///
+///////////////////////////
+
+
+constexpr uint64_t TIMEOUT = 5;
+constexpr uint32_t EVENT_COUNT = 1000;
+constexpr uint32_t TICKETS_PER_EVENT = 60000;
+
+constexpr std::size_t STORM_RESERVATIONS = 500000;
+// Requests timed after the storm, the first of which expires it.
+constexpr std::size_t STORM_PROBES = 10000;
+constexpr uint64_t MAX_STORM_LATENCY_NS = 60'000'000;
+
+constexpr std::size_t GROWTH_STEPS = 10;
+constexpr std::size_t GROWTH_RESERVATIONS_PER_STEP = 200000;
+constexpr double MAX_BYTES_PER_RESERVATION = 256;
+
+
+///////////////////////////
+///                     ///
+///     AUXILIARY       ///
+///     FUNCTIONS       ///
+///                     ///
+///////////////////////////
+
+
+namespace {
+    uint64_t elapsed_ns(std::chrono::steady_clock::time_point start) noexcept {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start
+        ).count();
+    }
+
+    // Resident set size in bytes, 0 if it cannot be read.
+    uint64_t resident_bytes() {
+        std::ifstream statm("/proc/self/statm");
+        uint64_t size;
+        uint64_t resident;
+        if (!(statm >> size >> resident))
+            return 0;
+        return resident * sysconf(_SC_PAGESIZE);
+    }
+
+    void add_events(Database &db) {
+        for (uint32_t event_id = 0; event_id < EVENT_COUNT; ++event_id)
+            db.add_event("Event " + std::to_string(event_id), TICKETS_PER_EVENT);
+        db.index_events();
+    }
+
+    bool report(const std::string &scenario, bool passed) {
+        std::cout << scenario << ": " << (passed ? "PASS" : "FAIL") << "\n";
+        return passed;
+    }
+}
+
+
+///////////////////////////
+///                     ///
+///      SCENARIOS      ///
+///                     ///
+///////////////////////////
+
+
+bool expiry_storm() {
+    VirtualClock clock(1);
+    Database db(TIMEOUT, clock);
+    add_events(db);
+
+    for (std::size_t i = 0; i < STORM_RESERVATIONS; ++i)
+        (void) db.make_reservation(i % EVENT_COUNT, 1);
+    clock.advance(TIMEOUT + 1);
+
+    uint64_t worst = 0;
+    uint64_t total = 0;
+    for (std::size_t i = 0; i < STORM_PROBES; ++i) {
+        const auto start = std::chrono::steady_clock::now();
+        const Reservation reservation = db.make_reservation(i % EVENT_COUNT, 1);
+        (void) db.get_tickets(reservation.reservation_id, reservation.cookie);
+        const uint64_t latency = elapsed_ns(start);
+        worst = std::max(worst, latency);
+        total += latency;
+    }
+
+    std::cout << "expiry_storm reservations=" << STORM_RESERVATIONS
+              << " pending_after=" << db.pending_expirations()
+              << " worst_ns=" << worst
+              << " mean_ns=" << total / STORM_PROBES
+              << " threshold_ns=" << MAX_STORM_LATENCY_NS << "\n";
+    return report("expiry_storm",
+                  db.live_reservations() == 0 && worst <= MAX_STORM_LATENCY_NS);
+}
+
+// Measured from a baseline taken after the events were added, so that
+// only the reservations count.
+bool memory_growth() {
+    VirtualClock clock(1);
+    Database db(TIMEOUT, clock);
+    add_events(db);
+    const uint64_t baseline = resident_bytes();
+
+    double worst = 0;
+    std::vector<Sale> sales;
+    for (std::size_t step = 1; step <= GROWTH_STEPS; ++step) {
+        for (std::size_t i = 0; i < GROWTH_RESERVATIONS_PER_STEP; ++i) {
+            const Reservation reservation = db.make_reservation(i % EVENT_COUNT, 1);
+            if (i % 2)
+                (void) db.get_tickets(reservation.reservation_id, reservation.cookie);
+        }
+        db.take_sales(sales);
+
+        const std::size_t reservations = db.live_reservations() + db.collected_reservations();
+        const uint64_t resident = resident_bytes();
+        const double per_reservation =
+            static_cast<double>(resident > baseline ? resident - baseline : 0) / reservations;
+        worst = std::max(worst, per_reservation);
+        std::cout << "memory_growth step=" << step
+                  << " live=" << db.live_reservations()
+                  << " collected=" << db.collected_reservations()
+                  << " rss_bytes=" << resident
+                  << " bytes_per_reservation=" << per_reservation << "\n";
+    }
+
+    std::cout << "memory_growth worst_bytes_per_reservation=" << worst
+              << " threshold=" << MAX_BYTES_PER_RESERVATION << "\n";
+    return report("memory_growth", resident_bytes() && worst <= MAX_BYTES_PER_RESERVATION);
+}
+
+// Memory first, so that the heap it measures has not been grown by the
+// storm already.
+int main() {
+    bool passed = memory_growth();
+    passed = expiry_storm() && passed;
+    return passed ? 0 : 1;
+}
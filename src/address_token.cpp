@@ -0,0 +1,61 @@
+#include "address_token.h"
+
+
+///////////////////////////
+///                     ///
+///     AUXILIARY       ///
+///     FUNCTIONS       ///
+///                     ///
+///////////////////////////
+
+
+namespace {
+    constexpr uint64_t rotate(uint64_t x, int bits) noexcept {
+        return (x << bits) | (x >> (64 - bits));
+    }
+
+    struct SipState {
+        uint64_t v0, v1, v2, v3;
+
+        void round() noexcept {
+            v0 += v1; v1 = rotate(v1, 13); v1 ^= v0; v0 = rotate(v0, 32);
+            v2 += v3; v3 = rotate(v3, 16); v3 ^= v2;
+            v0 += v3; v3 = rotate(v3, 21); v3 ^= v0;
+            v2 += v1; v1 = rotate(v1, 17); v1 ^= v2; v2 = rotate(v2, 32);
+        }
+
+        void compress(uint64_t word) noexcept {
+            v3 ^= word;
+            round();
+            round();
+            v0 ^= word;
+        }
+    };
+}
+
+
+///////////////////////////
+///                     ///
+///    ADDRESS TOKEN    ///
+///                     ///
+///////////////////////////
+
+
+// SipHash-2-4 of the 16-byte message (client, period), both little-endian
+// words, so that the tokens match the reference implementation.
+uint64_t AddressToken::mac(uint64_t client, uint64_t period) const noexcept {
+    SipState state{
+        m_key0 ^ 0x736f6d6570736575ULL,
+        m_key1 ^ 0x646f72616e646f6dULL,
+        m_key0 ^ 0x6c7967656e657261ULL,
+        m_key1 ^ 0x7465646279746573ULL
+    };
+    state.compress(client);
+    state.compress(period);
+    state.compress(uint64_t{16} << 56); // message length, no remaining bytes
+
+    state.v2 ^= 0xff;
+    for (int i = 0; i < 4; ++i)
+        state.round();
+    return state.v0 ^ state.v1 ^ state.v2 ^ state.v3;
+}
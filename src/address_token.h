@@ -0,0 +1,43 @@
+#ifndef __ADDRESS_TOKEN_H__
+#define __ADDRESS_TOKEN_H__
+
+#include "clock.h"
+
+#include <cstdint>
+
+// Stateless proof that a client receives replies at its source address:
+// a SipHash-2-4 MAC over the address (as returned by address_to_id()) and
+// the current time period. A token stays valid until the end of the
+// period after the one it was issued in.
+class AddressToken {
+public:
+    static constexpr uint64_t PERIOD = 30; // seconds
+
+private:
+    uint64_t        m_key0;
+    uint64_t        m_key1;
+    const Clock    &m_clock;
+
+public:
+    AddressToken() = delete;
+    AddressToken(uint64_t key0, uint64_t key1,
+                 const Clock &clock = SystemClock::instance()) noexcept
+    : m_key0{key0}
+    , m_key1{key1}
+    , m_clock{clock} {}
+    ~AddressToken() = default;
+
+    uint64_t issue(uint64_t client) const noexcept {
+        return mac(client, m_clock.now() / PERIOD);
+    }
+
+    bool validate(uint64_t client, uint64_t token) const noexcept {
+        const uint64_t period = m_clock.now() / PERIOD;
+        return token == mac(client, period) || (period && token == mac(client, period - 1));
+    }
+
+private:
+    uint64_t mac(uint64_t client, uint64_t period) const noexcept;
+};
+
+#endif // __ADDRESS_TOKEN_H__
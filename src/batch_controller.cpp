@@ -0,0 +1,30 @@
+#include "batch_controller.h"
+
+#include <algorithm>
+
+
+///////////////////////////
+///                     ///
+///  BATCH CONTROLLER   ///
+///                     ///
+///////////////////////////
+
+
+void BatchController::update(std::size_t received, std::size_t backlog) noexcept {
+    const std::size_t size = batch_size();
+    if (received >= size || backlog > size)
+        m_size.store(std::min(m_max_size, size + m_increase), std::memory_order_relaxed);
+    else if (received && received < size / 2)
+        m_size.store(std::max(m_min_size, size / 2), std::memory_order_relaxed);
+
+    // A single request filling a batch of the minimum size is no sign of
+    // load, so it does not start polling.
+    if ((received >= size && size > m_min_size) || backlog) {
+        m_empty_polls = 0;
+        m_polling.store(true, std::memory_order_relaxed);
+    } else if (received) {
+        m_empty_polls = 0;
+    } else if (polling() && ++m_empty_polls >= m_poll_limit) {
+        m_polling.store(false, std::memory_order_relaxed);
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef __BATCH_CONTROLLER_H__
+#define __BATCH_CONTROLLER_H__
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib> // std::size_t
+
+// Adapts the receive batch size and the waiting mode to the load, AIMD
+// style. A batch filled to the brim (or a backlog longer than a batch)
+// means more requests are waiting, so the size grows by a constant; a
+// batch less than half full halves it. Small batches keep latency low
+// when requests are few, full ones save syscalls when they are many.
+//
+// Under sustained load (a batch above the minimum size filled, or requests
+// left waiting) the loop also stops blocking in the kernel (polling),
+// until `poll_limit` receives in a row come back empty. Empty receives
+// while polling leave the size alone.
+class BatchController {
+private:
+    const std::size_t           m_min_size;
+    const std::size_t           m_max_size;
+    const std::size_t           m_increase;
+    const std::size_t           m_poll_limit;
+    std::size_t                 m_empty_polls;
+    // Written by the owner only; atomic so that metrics can read them.
+    std::atomic<std::size_t>    m_size;
+    std::atomic<bool>           m_polling;
+
+public:
+    BatchController() = delete;
+    BatchController(std::size_t min_size, std::size_t max_size, std::size_t increase,
+                    std::size_t poll_limit) noexcept
+    : m_min_size{min_size}
+    , m_max_size{max_size}
+    , m_increase{increase}
+    , m_poll_limit{poll_limit}
+    , m_empty_polls{0}
+    , m_size{min_size}
+    , m_polling{false} {}
+    ~BatchController() = default;
+
+    std::size_t batch_size() const noexcept {
+        return m_size.load(std::memory_order_relaxed);
+    }
+
+    bool polling() const noexcept {
+        return m_polling.load(std::memory_order_relaxed);
+    }
+
+    // Called after every receive with the number of datagrams received
+    // and the number of requests still waiting to be served.
+    void update(std::size_t received, std::size_t backlog) noexcept;
+};
+
+#endif // __BATCH_CONTROLLER_H__
@@ -0,0 +1,138 @@
+#include "catalog_loader.h"
+
+#include <cerrno>
+#include <cstring> // strerror
+#include <sstream>
+#include <utility>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+
+///////////////////////////
+///                     ///
+///   CATALOG LOADER    ///
+///                     ///
+///////////////////////////
+
+
+CatalogLoader::CatalogLoader(const std::string &path)
+: m_file{path}
+, m_ready_fd{-1}
+, m_loaded{false}
+, m_finished{false}
+, m_stopping{false}
+{
+    if (!m_file)
+        throw CatalogError("Could not open the events file: " + path);
+    m_ready_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_ready_fd < 0)
+        throw CatalogError(std::string{"Could not create an eventfd: "} + strerror(errno));
+    m_parser = std::thread([this] { parse(); });
+}
+
+CatalogLoader::~CatalogLoader() {
+    m_stopping.store(true, std::memory_order_relaxed);
+    m_parser.join();
+    close(m_ready_fd);
+}
+
+// can throw
+bool CatalogLoader::integrate(Database &db, bool wait) {
+    if (m_loaded)
+        return true;
+
+    // Cleared before taking the chunks, so that no chunk queued after
+    // them can go unnoticed.
+    uint64_t signals;
+    [[maybe_unused]] const ssize_t ignored = read(m_ready_fd, &signals, sizeof(signals));
+
+    std::deque<Chunk> chunks;
+    EventIndexes indexes;
+    bool finished;
+    {
+        std::unique_lock lock(m_mutex);
+        if (wait)
+            m_ready.wait(lock, [this] { return m_finished || !m_chunks.empty(); });
+        chunks.swap(m_chunks);
+        finished = m_finished;
+        if (m_error)
+            std::rethrow_exception(m_error);
+        if (finished)
+            indexes = std::move(m_indexes);
+    }
+
+    for (auto &chunk : chunks)
+        for (auto &event : chunk)
+            db.add_event(std::move(event.description), event.ticket_counts, event.external_id);
+
+    // m_finished is set along with queueing the last chunk, so no chunk
+    // can be left behind.
+    if (finished) {
+        db.set_indexes(std::move(indexes));
+        m_loaded = true;
+    }
+    return m_loaded;
+}
+
+void CatalogLoader::parse() {
+    auto hand_over = [this](Chunk &chunk, bool finished, std::exception_ptr error) {
+        {
+            std::lock_guard lock(m_mutex);
+            if (!chunk.empty())
+                m_chunks.push_back(std::move(chunk));
+            m_finished = finished;
+            m_error = error;
+        }
+        m_ready.notify_one();
+        const uint64_t signal = 1;
+        [[maybe_unused]] const ssize_t ignored = write(m_ready_fd, &signal, sizeof(signal));
+        chunk.clear();
+        chunk.reserve(CHUNK_SIZE);
+    };
+
+    Chunk chunk;
+    chunk.reserve(CHUNK_SIZE);
+    EventIndexer indexer;
+    try {
+        std::string description;
+        std::string count_line;
+        for (uint64_t event_id = 0;
+             std::getline(m_file, description) && std::getline(m_file, count_line);
+             ++event_id)
+        {
+            if (m_stopping.load(std::memory_order_relaxed))
+                return;
+
+            std::istringstream fields(count_line);
+            std::vector<uint32_t> ticket_counts;
+            do {
+                uint64_t ticket_count;
+                if (!(fields >> ticket_count) || ticket_count > UINT32_MAX)
+                    throw CatalogError("Invalid ticket count: " + count_line);
+                ticket_counts.push_back(ticket_count);
+            } while (fields.peek() == ',' && fields.get());
+            if (ticket_counts.size() > MAX_CATEGORIES)
+                throw CatalogError("Too many ticket categories: " + count_line);
+
+            uint64_t external_id;
+            if (!(fields >> external_id))
+                external_id = event_id;
+            indexer.add(external_id, description, static_cast<uint8_t>(ticket_counts.size()));
+            chunk.push_back(ParsedEvent{std::move(description), std::move(ticket_counts),
+                                        external_id});
+            if (chunk.size() >= CHUNK_SIZE)
+                hand_over(chunk, false, nullptr);
+        }
+        // The last events are served while they are being indexed.
+        hand_over(chunk, false, nullptr);
+        EventIndexes indexes = indexer.build();
+        {
+            std::lock_guard lock(m_mutex);
+            m_indexes = std::move(indexes);
+        }
+        hand_over(chunk, true, nullptr);
+    } catch (...) {
+        hand_over(chunk, true, std::current_exception());
+    }
+}
@@ -0,0 +1,94 @@
+#ifndef __CATALOG_LOADER_H__
+#define __CATALOG_LOADER_H__
+
+#include "database.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+class CatalogError : public std::runtime_error {
+public:
+    CatalogError(const std::string &what_arg)
+    : std::runtime_error{what_arg} {}
+};
+
+// Parses the events file on a thread of its own and hands the events over
+// in chunks of consecutive IDs, so that the server can serve the first
+// ones while the rest are still being read. The events are indexed on
+// that thread too, as they are parsed (see EventIndexer), and the indexes
+// handed over after the last chunk.
+//
+// The events file consists of pairs of lines: a description and a ticket
+// count. Events with several ticket categories list a comma-separated count
+// per category instead. The counts may be followed by the event's 64-bit ID
+// in the upstream catalog; events without one are known by their position
+// in the file.
+class CatalogLoader {
+public:
+    static constexpr std::size_t CHUNK_SIZE = 4096; // events
+    // So that the ticket counts of every chunk's events can be restored
+    // along with it, see Database::restorable().
+    static_assert(CHUNK_SIZE % StatePage::EVENTS_PER_PAGE == 0);
+
+private:
+    struct ParsedEvent {
+        std::string             description;
+        std::vector<uint32_t>   ticket_counts;
+        uint64_t                external_id;
+    };
+
+    using Chunk = std::vector<ParsedEvent>;
+
+    std::ifstream               m_file;
+    int                         m_ready_fd; // eventfd, readable when a chunk is
+    bool                        m_loaded;   // every event has been integrated
+
+    std::mutex                  m_mutex;
+    std::condition_variable     m_ready;
+    std::deque<Chunk>           m_chunks;
+    EventIndexes                m_indexes; // set before m_finished
+    bool                        m_finished;
+    std::exception_ptr          m_error;
+    std::atomic<bool>           m_stopping;
+    std::thread                 m_parser;
+
+public:
+    CatalogLoader() = delete;
+    // can throw
+    explicit CatalogLoader(const std::string &path);
+    ~CatalogLoader();
+
+    CatalogLoader(const CatalogLoader&) = delete;
+    CatalogLoader &operator=(const CatalogLoader&) = delete;
+
+    // can throw
+    // Adds the events parsed since the last call to `db`, waiting for at
+    // least one chunk if `wait` is set. Once the last one has been added,
+    // sets the indexes and returns true. `db` has to get its events from
+    // here only.
+    bool integrate(Database &db, bool wait = false);
+
+    bool loaded() const noexcept {
+        return m_loaded;
+    }
+
+    // Becomes readable whenever there is something to integrate, so that
+    // it can be polled along with the sockets.
+    int ready_fd() const noexcept {
+        return m_ready_fd;
+    }
+
+private:
+    void parse();
+};
+
+#endif // __CATALOG_LOADER_H__
@@ -0,0 +1,365 @@
+#include "checkpoint.h"
+
+#include <algorithm>
+#include <cstdio> // snprintf
+#include <cstring> // memcpy
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <utility>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+
+///////////////////////////
+///                     ///
+///      CONSTANTS      ///
+///                     ///
+///////////////////////////
+
+
+constexpr char MAGIC[4] = {'T', 'S', 'C', 'P'};
+constexpr uint32_t FORMAT_VERSION = 1;
+constexpr std::size_t HEADER_SIZE = sizeof(MAGIC) + 4 + 8 + 4;
+constexpr std::size_t HASH_SIZE = 8;
+constexpr char BASE_EXTENSION[] = ".base";
+constexpr char INCREMENT_EXTENSION[] = ".incr";
+constexpr char TEMPORARY_EXTENSION[] = ".tmp";
+
+
+///////////////////////////
+///                     ///
+///     AUXILIARY       ///
+///     FUNCTIONS       ///
+///                     ///
+///////////////////////////
+
+
+namespace {
+    namespace fs = std::filesystem;
+
+    struct CheckpointFile {
+        uint64_t    sequence;
+        bool        base;
+        fs::path    path;
+    };
+
+    // Latest version of every page, ordered by kind and index.
+    using PageMap = std::map<std::pair<uint8_t, uint32_t>, std::string>;
+
+    template<typename T>
+    void put(std::string &bytes, T value) {
+        bytes.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    template<typename T>
+    T get(const char *bytes) noexcept {
+        T value;
+        memcpy(&value, bytes, sizeof(T));
+        return value;
+    }
+
+    uint64_t fnv1a(const char *bytes, std::size_t length) noexcept {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (std::size_t i = 0; i < length; ++i) {
+            hash ^= static_cast<uint8_t>(bytes[i]);
+            hash *= 0x100000001b3ULL;
+        }
+        return hash;
+    }
+
+    std::string file_name(uint64_t sequence, bool base) {
+        char name[17];
+        snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(sequence));
+        return std::string{name} + (base ? BASE_EXTENSION : INCREMENT_EXTENSION);
+    }
+
+    // can throw
+    // Checkpoint files in the directory, ordered by sequence number.
+    std::vector<CheckpointFile> list_files(const std::string &directory) {
+        std::vector<CheckpointFile> result;
+        for (const auto &entry : fs::directory_iterator(directory)) {
+            const fs::path &path = entry.path();
+            const std::string extension = path.extension().string();
+            if (extension != BASE_EXTENSION && extension != INCREMENT_EXTENSION)
+                continue;
+            const std::string stem = path.stem().string();
+            char *end;
+            const uint64_t sequence = strtoull(stem.c_str(), &end, 16);
+            if (stem.empty() || *end)
+                continue;
+            result.push_back(CheckpointFile{sequence, extension == BASE_EXTENSION, path});
+        }
+        std::sort(result.begin(), result.end(),
+                  [](const CheckpointFile &a, const CheckpointFile &b) {
+                      return a.sequence < b.sequence;
+                  });
+        return result;
+    }
+
+    // The newest base (if any) and the increments after it. An increment
+    // with the base's sequence number has been merged into it already.
+    std::vector<CheckpointFile> current_chain(const std::vector<CheckpointFile> &files) {
+        auto base = std::find_if(files.rbegin(), files.rend(),
+                                 [](const CheckpointFile &file) { return file.base; });
+        const uint64_t base_sequence = (base == files.rend()) ? 0 : base->sequence;
+
+        std::vector<CheckpointFile> result;
+        if (base != files.rend())
+            result.push_back(*base);
+        for (const auto &file : files)
+            if (!file.base && file.sequence > base_sequence)
+                result.push_back(file);
+        return result;
+    }
+
+    // can throw
+    void read_checkpoint(const fs::path &path, PageMap &pages) {
+        const CheckpointError invalid("Invalid checkpoint: " + path.string());
+        std::ifstream file(path, std::ios::binary);
+        if (!file)
+            throw invalid;
+        const std::string bytes{std::istreambuf_iterator<char>(file),
+                                std::istreambuf_iterator<char>()};
+        if (bytes.size() < HEADER_SIZE + HASH_SIZE)
+            throw invalid;
+
+        const std::size_t end = bytes.size() - HASH_SIZE;
+        if (memcmp(bytes.data(), MAGIC, sizeof(MAGIC))
+            || get<uint32_t>(&bytes[sizeof(MAGIC)]) != FORMAT_VERSION
+            || get<uint64_t>(&bytes[end]) != fnv1a(bytes.data(), end))
+            throw invalid;
+
+        const uint32_t count = get<uint32_t>(&bytes[HEADER_SIZE - 4]);
+        std::size_t offset = HEADER_SIZE;
+        for (uint32_t i = 0; i < count; ++i) {
+            if (end - offset < 1 + 4 + 4)
+                throw invalid;
+            const uint8_t kind = bytes[offset];
+            const uint32_t index = get<uint32_t>(&bytes[offset + 1]);
+            const uint32_t length = get<uint32_t>(&bytes[offset + 5]);
+            offset += 1 + 4 + 4;
+            if (end - offset < length)
+                throw invalid;
+            pages[{kind, index}].assign(&bytes[offset], length);
+            offset += length;
+        }
+        if (offset != end)
+            throw invalid;
+    }
+
+    // can throw
+    PageMap read_chain(const std::string &directory) {
+        PageMap pages;
+        for (const auto &file : current_chain(list_files(directory)))
+            read_checkpoint(file.path, pages);
+        return pages;
+    }
+
+    // can throw
+    void sync_path(const fs::path &path, int flags) {
+        const int fd = open(path.c_str(), flags);
+        if (fd < 0 || fsync(fd) < 0) {
+            if (fd >= 0)
+                close(fd);
+            throw CheckpointError("Could not sync: " + path.string());
+        }
+        close(fd);
+    }
+
+    // can throw
+    void write_checkpoint(const std::string &directory, uint64_t sequence, bool base,
+                          const std::vector<StatePage> &pages)
+    {
+        std::string bytes(MAGIC, sizeof(MAGIC));
+        put(bytes, FORMAT_VERSION);
+        put(bytes, sequence);
+        put(bytes, static_cast<uint32_t>(pages.size()));
+        for (const auto &page : pages) {
+            put(bytes, page.kind);
+            put(bytes, page.index);
+            put(bytes, static_cast<uint32_t>(page.data.size()));
+            bytes += page.data;
+        }
+        put(bytes, fnv1a(bytes.data(), bytes.size()));
+
+        const fs::path path = fs::path(directory) / file_name(sequence, base);
+        fs::path temporary = path;
+        temporary += TEMPORARY_EXTENSION;
+        {
+            std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+            file.write(bytes.data(), bytes.size());
+            file.close();
+            if (!file)
+                throw CheckpointError("Could not write: " + temporary.string());
+        }
+        sync_path(temporary, O_RDONLY);
+        fs::rename(temporary, path);
+        sync_path(directory, O_RDONLY | O_DIRECTORY);
+    }
+
+    // Adds `newer` to `pages`, replacing the versions of its pages there.
+    // Leaves `newer` empty.
+    void add_pages(std::vector<StatePage> &pages, std::vector<StatePage> &newer) {
+        if (pages.empty()) {
+            pages.swap(newer);
+            return;
+        }
+        std::map<std::pair<uint8_t, uint32_t>, std::size_t> positions;
+        for (std::size_t i = 0; i < pages.size(); ++i)
+            positions[{pages[i].kind, pages[i].index}] = i;
+        for (auto &page : newer) {
+            const auto [position, added] =
+                positions.try_emplace({page.kind, page.index}, pages.size());
+            if (added)
+                pages.push_back(std::move(page));
+            else
+                pages[position->second] = std::move(page);
+        }
+        newer.clear();
+    }
+}
+
+
+///////////////////////////
+///                     ///
+///    CHECKPOINTER     ///
+///                     ///
+///////////////////////////
+
+
+Checkpointer::Checkpointer(const std::string &directory, uint64_t interval,
+                           std::size_t merge_after)
+: m_directory{directory}
+, m_interval{interval}
+, m_merge_after{merge_after}
+, m_last_time{0}
+, m_sequence{0}
+, m_increments{0}
+, m_stopping{false}
+, m_pages_written{0}
+, m_write_failures{0}
+{
+    try {
+        fs::create_directories(m_directory);
+        // Left behind by a crash while writing.
+        for (const auto &entry : fs::directory_iterator(m_directory))
+            if (entry.path().extension() == TEMPORARY_EXTENSION)
+                fs::remove(entry.path());
+
+        const auto files = list_files(m_directory);
+        if (!files.empty())
+            m_sequence = files.back().sequence;
+        for (const auto &file : current_chain(files))
+            m_increments += !file.base;
+    } catch (const fs::filesystem_error &e) {
+        throw CheckpointError(e.what());
+    }
+    m_writer = std::thread([this] { write_checkpoints(); });
+}
+
+Checkpointer::~Checkpointer() {
+    {
+        std::lock_guard lock(m_mutex);
+        m_stopping = true;
+    }
+    m_wakeup.notify_one();
+    m_writer.join();
+}
+
+// can throw
+void Checkpointer::read_pages(std::vector<StatePage> &pages) const {
+    try {
+        for (auto &[key, data] : read_chain(m_directory))
+            pages.push_back(StatePage{key.first, key.second, std::move(data)});
+    } catch (const fs::filesystem_error &e) {
+        throw CheckpointError(e.what());
+    }
+}
+
+void Checkpointer::checkpoint(Database &db) {
+    Pages pages;
+    db.take_dirty_pages(pages);
+    if (pages.empty())
+        return;
+    {
+        std::lock_guard lock(m_mutex);
+        add_pages(m_pending, pages);
+    }
+    m_wakeup.notify_one();
+}
+
+void Checkpointer::checkpoint_if_stale(Database &db, uint64_t now) {
+    if (now - m_last_time < m_interval)
+        return;
+    m_last_time = now;
+    checkpoint(db);
+}
+
+// Sequence numbers are assigned here, in the order checkpoints were taken.
+// A checkpoint that fails to be written is retried (with the ones taken
+// meanwhile added to it); a failed merge is retried after the next one.
+void Checkpointer::write_checkpoints() {
+    Pages pages; // not empty - failed to be written
+    while (true) {
+        {
+            std::unique_lock lock(m_mutex);
+            m_wakeup.wait(lock, [this, &pages] {
+                return m_stopping || !m_pending.empty() || !pages.empty();
+            });
+            if (m_pending.empty() && pages.empty())
+                return;
+            add_pages(pages, m_pending);
+        }
+
+        if (!write_increment(pages)) {
+            m_write_failures.fetch_add(1, std::memory_order_relaxed);
+            std::unique_lock lock(m_mutex);
+            if (m_wakeup.wait_for(lock, RETRY_DELAY, [this] { return m_stopping; })) {
+                std::cerr << "Giving up on checkpoints, the last changes are lost.\n";
+                return;
+            }
+            continue;
+        }
+        pages.clear();
+
+        if (++m_increments >= m_merge_after) {
+            try {
+                merge();
+            } catch (const std::exception &e) {
+                m_write_failures.fetch_add(1, std::memory_order_relaxed);
+                std::cerr << "Merging checkpoints has failed: " << e.what() << "\n";
+            }
+        }
+    }
+}
+
+bool Checkpointer::write_increment(const Pages &pages) {
+    try {
+        write_checkpoint(m_directory, m_sequence + 1, false, pages);
+    } catch (const std::exception &e) {
+        std::cerr << "Writing a checkpoint has failed: " << e.what() << "\n";
+        return false;
+    }
+    ++m_sequence;
+    m_pages_written.fetch_add(pages.size(), std::memory_order_relaxed);
+    return true;
+}
+
+// can throw
+// The new base takes the sequence number of the last increment, which
+// makes the files before it obsolete even if removing them fails.
+void Checkpointer::merge() {
+    Pages pages;
+    for (auto &[key, data] : read_chain(m_directory))
+        pages.push_back(StatePage{key.first, key.second, std::move(data)});
+    write_checkpoint(m_directory, m_sequence, true, pages);
+    m_increments = 0;
+
+    for (const auto &file : list_files(m_directory))
+        if (file.sequence < m_sequence || (file.sequence == m_sequence && !file.base))
+            fs::remove(file.path);
+}
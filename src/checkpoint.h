@@ -0,0 +1,105 @@
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+
+#include "database.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+class CheckpointError : public std::runtime_error {
+public:
+    CheckpointError(const std::string &what_arg)
+    : std::runtime_error{what_arg} {}
+};
+
+// Incremental checkpoints of a Database, kept in a directory of their own.
+// A checkpoint holds only the pages changed since the previous one (see
+// Database::take_dirty_pages()), so its size follows the churn rather than
+// the size of the state. Once `merge_after` of them have piled up, they
+// are merged with the base they build on into a new base, and the files
+// it replaces are removed. Pages are taken on the calling thread; files
+// are written and merged by a thread of the checkpointer's. Checkpoints
+// taken while it is still writing (or retrying a failed write) are
+// combined into one, keeping the newest version of every page, so at most
+// two of them are held in memory.
+//
+// Files are named after their sequence number (16 hex digits) and end in
+// .base or .incr. They are written under a temporary name and renamed once
+// synced, so a crash leaves either a whole file or none of it:
+//   4 bytes   "TSCP"
+//   uint32    format version
+//   uint64    sequence number
+//   uint32    page count
+//   pages     kind (uint8), index (uint32), data length (uint32), data
+//   uint64    FNV-1a hash of everything before
+// The state is that of the newest base with the increments after it.
+class Checkpointer {
+public:
+    static constexpr std::chrono::seconds RETRY_DELAY{1};
+
+private:
+    using Pages = std::vector<StatePage>;
+
+    const std::string           m_directory;
+    const uint64_t              m_interval;
+    const std::size_t           m_merge_after;
+    uint64_t                    m_last_time;
+    uint64_t                    m_sequence; // of the newest checkpoint taken
+    std::size_t                 m_increments; // since the newest base, writer only
+
+    std::mutex                  m_mutex;
+    std::condition_variable     m_wakeup;
+    Pages                       m_pending; // empty - nothing to write
+    bool                        m_stopping;
+    std::atomic<uint64_t>       m_pages_written;
+    std::atomic<uint64_t>       m_write_failures;
+    std::thread                 m_writer;
+
+public:
+    Checkpointer() = delete;
+    // can throw
+    // Checkpoints are taken at most every `interval` seconds, as long as
+    // checkpoint_if_stale() is called regularly.
+    Checkpointer(const std::string &directory, uint64_t interval, std::size_t merge_after);
+    // Writes the checkpoints taken so far (trying once more at most if
+    // writing fails).
+    ~Checkpointer();
+
+    Checkpointer(const Checkpointer&) = delete;
+    Checkpointer &operator=(const Checkpointer&) = delete;
+
+    // can throw
+    // Appends the checkpointed pages, ordered by kind and index, to
+    // `pages`, for Database::restore_page(). Has to be called before the
+    // first checkpoint.
+    void read_pages(std::vector<StatePage> &pages) const;
+
+    void checkpoint(Database &db);
+
+    void checkpoint_if_stale(Database &db, uint64_t now);
+
+    // Safe to call from any thread.
+    uint64_t pages_written() const noexcept {
+        return m_pages_written.load(std::memory_order_relaxed);
+    }
+
+    // Safe to call from any thread.
+    uint64_t write_failures() const noexcept {
+        return m_write_failures.load(std::memory_order_relaxed);
+    }
+
+private:
+    void write_checkpoints();
+    bool write_increment(const Pages &pages);
+    // can throw
+    void merge();
+};
+
+#endif // __CHECKPOINT_H__
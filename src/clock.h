@@ -0,0 +1,71 @@
+#ifndef __CLOCK_H__
+#define __CLOCK_H__
+
+#include <chrono>
+#include <cstdint>
+
+// Source of the current time (in seconds since the epoch) used for
+// reservation expiration.
+class Clock {
+public:
+    virtual ~Clock() = default;
+    virtual uint64_t now() const noexcept = 0;
+
+    // In milliseconds, for intervals shorter than a second.
+    virtual uint64_t now_ms() const noexcept {
+        return now() * 1000;
+    }
+};
+
+class SystemClock : public Clock {
+public:
+    SystemClock() = default;
+    ~SystemClock() = default;
+
+    uint64_t now() const noexcept override {
+        return static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::seconds>(
+                std::chrono::system_clock::now().time_since_epoch()
+            ).count()
+        );
+    }
+
+    uint64_t now_ms() const noexcept override {
+        return static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::system_clock::now().time_since_epoch()
+            ).count()
+        );
+    }
+
+    static SystemClock &instance() noexcept {
+        static SystemClock clock;
+        return clock;
+    }
+};
+
+// A clock that only moves when told to. Lets benchmarks and replays
+// go through hours of expirations instantly and deterministically.
+class VirtualClock : public Clock {
+private:
+    uint64_t m_seconds;
+
+public:
+    VirtualClock(uint64_t seconds = 0)
+    : m_seconds{seconds} {}
+    ~VirtualClock() = default;
+
+    uint64_t now() const noexcept override {
+        return m_seconds;
+    }
+
+    void advance(uint64_t seconds) noexcept {
+        m_seconds += seconds;
+    }
+
+    void set(uint64_t seconds) noexcept {
+        m_seconds = seconds;
+    }
+};
+
+#endif // __CLOCK_H__
@@ -1,9 +1,80 @@
 #ifndef __COMMON_H__
 #define __COMMON_H__
 
+#include <cstddef>
+#include <cstdint>
+
 constexpr int TICKET_LEN = 7;
 constexpr size_t MAX_CONTENT_SIZE = 65507;
 constexpr uint16_t MAX_TICKET_COUNT = (MAX_CONTENT_SIZE - 1 - 4 - 2) / TICKET_LEN;
+// Tickets in a single TICKET_CHUNK message.
+constexpr uint16_t TICKETS_PER_CHUNK = (MAX_CONTENT_SIZE - 1 - 4 - 4 - 2) / TICKET_LEN;
 
-#endif // __COMMON_H__
+// The 2-byte ticket counts of EVENTS listings report larger counts as
+// this, i.e. it stands for "at least 65535". GET_COUNTS, AVAILABILITY and
+// EVENT_CATEGORIES report them exactly.
+constexpr uint16_t SATURATED_TICKET_COUNT = UINT16_MAX;
+
+// Message IDs
+constexpr uint8_t GET_EVENTS = 1;
+constexpr uint8_t EVENTS = 2;
+constexpr uint8_t GET_RESERVATION = 3;
+constexpr uint8_t RESERVATION = 4;
+constexpr uint8_t GET_TICKETS = 5;
+constexpr uint8_t TICKETS = 6;
+// Same as GET_RESERVATION, but the event is named by its 64-bit catalog ID.
+constexpr uint8_t GET_RESERVATION_EXTERNAL = 7;
+// Substring search over event descriptions, for queries of 3 or more bytes.
+constexpr uint8_t SEARCH = 8;
+constexpr uint8_t SEARCH_RESULT = 9;
+// Events listing with per-category ticket counts.
+constexpr uint8_t GET_EVENT_CATEGORIES = 10;
+constexpr uint8_t EVENT_CATEGORIES = 11;
+// Reservations of any size, collected with GET_TICKET_CHUNK.
+constexpr uint8_t GET_LARGE_RESERVATION = 12;
+constexpr uint8_t LARGE_RESERVATION = 13;
+constexpr uint8_t GET_TICKET_CHUNK = 14;
+constexpr uint8_t TICKET_CHUNK = 15;
+// Queues the client for tickets; it gets a RESERVATION once they are available.
+constexpr uint8_t WAITLIST = 16;
+constexpr uint8_t WAITLISTED = 17;
+// Ticket counts of the listed events only.
+constexpr uint8_t GET_AVAILABILITY = 18;
+constexpr uint8_t AVAILABILITY = 19;
+// Reply to GET_TICKETS for clients that set CAPABILITY_TICKET_RANGES, while
+// ticket codes are consecutive (no ticket key, -k 0). With a ticket key,
+// such requests get TICKETS as usual.
+constexpr uint8_t TICKET_RANGES = 20;
+// Descriptions for a catalog version, cacheable until the version changes.
+constexpr uint8_t GET_CATALOG = 21;
+constexpr uint8_t CATALOG = 22;
+// Current ticket counts for a catalog version.
+constexpr uint8_t GET_COUNTS = 23;
+constexpr uint8_t COUNTS = 24;
+// Events whose descriptions contain the query (as in SEARCH), replied with EVENTS.
+constexpr uint8_t SEARCH_EVENTS = 25;
+// Whether a ticket code belongs to a collected reservation, e.g. for checking
+// tickets at the gate. Only served on the partner port.
+constexpr uint8_t CHECK_TICKET = 26;
+constexpr uint8_t TICKET_STATUS = 27;
+// A request prefixed with an address token. With address verification
+// (-v 1), replies more than 3 times larger than the request are not sent to
+// unverified addresses, and neither are those reserving or collecting
+// tickets (and WAITLIST). Such requests get a TOKEN to prefix them with
+// instead, if they are at least as long as TOKEN; GET_TOKEN (padded to
+// that length with zeros) always does. Without it, VERIFIED is accepted
+// and the token ignored.
+constexpr uint8_t VERIFIED = 28;
+constexpr uint8_t TOKEN = 29;
+// Reply to requests that need events the server has not loaded yet, and
+// to listings (GET_EVENTS, GET_EVENT_CATEGORIES, GET_CATALOG, GET_COUNTS,
+// SEARCH, SEARCH_EVENTS) until every event has been loaded, with the
+// number of events loaded so far.
+constexpr uint8_t RETRY_LATER = 30;
+constexpr uint8_t GET_TOKEN = 31;
+constexpr uint8_t BAD_REQUEST = 255;
 
+// Flags of the optional capabilities byte ending GET_TICKETS.
+constexpr uint8_t CAPABILITY_TICKET_RANGES = 1 << 0;
+
+#endif // __COMMON_H__
@@ -1,7 +1,12 @@
 #include "database.h"
 
+#include <algorithm>
+#include <climits>
 #include <cstring> // memcpy
-#include <chrono>  // time
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 
 ///////////////////////////
@@ -37,6 +42,14 @@ constexpr uint64_t SMALL_PRIMES[48 / 2] = {
 
 constexpr char MIN_COOKIE_CHAR = 33;
 constexpr uint32_t MIN_RESERVATION_ID = 10e6;
+// Granularity of the dirty page tracking.
+constexpr uint32_t EVENTS_PER_PAGE = StatePage::EVENTS_PER_PAGE;
+constexpr uint32_t RESERVATIONS_PER_PAGE = 256;
+// Reservation ID, event ID, ticket count, category, first ticket,
+// expiration time and whether it has been collected.
+constexpr std::size_t RESERVATION_RECORD_SIZE = 4 + 4 + 4 + 1 + 8 + 8 + 1;
+static_assert(EVENTS_PER_PAGE * MAX_CATEGORIES * sizeof(uint32_t) <= StatePage::MAX_SIZE);
+static_assert(RESERVATIONS_PER_PAGE * RESERVATION_RECORD_SIZE <= StatePage::MAX_SIZE);
 
 
 ///////////////////////////
@@ -66,6 +79,10 @@ const char *TooManyTickets::what() const noexcept {
     return "The number of tickets will not be able to be stored in a single datagram.";
 }
 
+const char *InvalidChunk::what() const noexcept {
+    return "The reservation does not have such a chunk of tickets.";
+}
+
 const char *InvalidReservationID::what() const noexcept {
     return "Invalid reservation ID.";
 }
@@ -74,6 +91,34 @@ const char *InvalidCookie::what() const noexcept {
     return "Invalid cookie.";
 }
 
+const char *InvalidCategory::what() const noexcept {
+    return "The event does not have such a ticket category.";
+}
+
+const char *WaitlistFull::what() const noexcept {
+    return "Too many clients are waiting for the event.";
+}
+
+const char *TooManyWaitlists::what() const noexcept {
+    return "The client is waiting for too many events.";
+}
+
+const char *DuplicateEventID::what() const noexcept {
+    return "Two events share the same external ID.";
+}
+
+const char *QueryTooShort::what() const noexcept {
+    return "The search query is too short.";
+}
+
+const char *TicketsNotConsecutive::what() const noexcept {
+    return "Ticket codes are permuted, so they do not form ranges.";
+}
+
+const char *InvalidStatePage::what() const noexcept {
+    return "The state page does not match the database.";
+}
+
 
 ///////////////////////////
 ///                     ///
@@ -83,21 +128,26 @@ const char *InvalidCookie::what() const noexcept {
 ///////////////////////////
 
 
-Event::Event(uint32_t event_id_, std::string &&description_, uint16_t ticket_count_)
+Event::Event(uint32_t event_id_, uint64_t external_id_,
+             std::string &&description_, uint8_t category_count_)
 : event_id{event_id_}
+, external_id{external_id_}
 , description{std::move(description_)}
-, ticket_count{ticket_count_} {}
+, category_count{category_count_} {}
 
-Event::Event(uint32_t event_id_, const std::string &description_, uint16_t ticket_count_)
+Event::Event(uint32_t event_id_, uint64_t external_id_,
+             const std::string &description_, uint8_t category_count_)
 : event_id{event_id_}
+, external_id{external_id_}
 , description{description_}
-, ticket_count{ticket_count_} {}
+, category_count{category_count_} {}
 
-Reservation::Reservation(uint32_t reservation_id_, uint32_t event_id_,
-                         uint16_t ticket_count_, uint64_t expiration_time_)
+Reservation::Reservation(uint32_t reservation_id_, uint32_t event_id_, uint32_t ticket_count_,
+                         uint8_t category_, uint64_t expiration_time_)
 : reservation_id{reservation_id_}
 , event_id{event_id_}
 , ticket_count{ticket_count_}
+, category{category_}
 , expiration_time{expiration_time_}
 {
     generate_cookie();
@@ -122,14 +172,6 @@ void Reservation::generate_cookie() {
 
 
 namespace {
-    uint64_t get_seconds_from_epoch() {
-        return static_cast<uint64_t>(
-            std::chrono::duration_cast<std::chrono::seconds>(
-                std::chrono::system_clock::now().time_since_epoch()
-            ).count()
-        );
-    }
-
     bool cmp_cookies(char const *cookie1, char const *cookie2) noexcept {
         for (int i = 0; i < COOKIE_LEN; ++i)
             if (cookie1[i] != cookie2[i])
@@ -137,21 +179,22 @@ namespace {
         return true;
     }
 
-    void increase_ticket(char *ticket, uint16_t difference) noexcept {
-        auto to_int = [](char c) { return (c < 'A') ? c - '0' : c - 'A' + 10; };
-        auto to_char = [](int x) { return (x > 9) ? 'A' + x - 10 : '0' + x; };
-
-        const int offset = '9' - '0' + 1 + 'Z' - 'A' + 1;
+    // Pages are only read back by the same build, so numbers are stored
+    // in the host's byte order.
+    template<typename T>
+    void put(std::string &data, T value) {
+        data.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
 
-        for (int i = 0; i < TICKET_LEN; ++i) {
-            int value = difference % offset + to_int(ticket[i]);
-            difference /= offset;
-            if (value > offset) {
-                ++ticket[i + 1];
-                value -= offset;
-            }
-            ticket[i] = to_char(value);
-        }
+    // can throw
+    template<typename T>
+    T get(std::string_view &data) {
+        if (data.size() < sizeof(T))
+            throw InvalidStatePage();
+        T value;
+        memcpy(&value, data.data(), sizeof(T));
+        data.remove_prefix(sizeof(T));
+        return value;
     }
 }
 
@@ -165,14 +208,18 @@ namespace {
 
 struct Database::ReservationInfo {
     uint32_t    event_id;
-    uint16_t    ticket_count;
+    uint32_t    ticket_count;
+    uint8_t     category;
     char        cookie[COOKIE_LEN];
-    char        ticket_min[TICKET_LEN];
+    uint64_t    first_ticket; // counter value of the first ticket
+    uint64_t    expiration_time;
     bool        received = false;
 
     ReservationInfo(const Reservation &reservation)
     : event_id{reservation.event_id}
     , ticket_count{reservation.ticket_count}
+    , category{reservation.category}
+    , expiration_time{reservation.expiration_time}
     {
         memcpy(cookie, reservation.cookie, COOKIE_LEN);
     }
@@ -193,37 +240,237 @@ struct Database::ReservationTime {
 
 
 
-Database::Database(uint64_t timeout_)
+struct Database::Waiter {
+    uint64_t client;
+    uint16_t ticket_count;
+
+    Waiter(uint64_t client_, uint16_t ticket_count_)
+    : client{client_}
+    , ticket_count{ticket_count_} {}
+
+    ~Waiter() = default;
+};
+
+namespace {
+    uint64_t fnv1a(const void *bytes, std::size_t length, uint64_t hash) noexcept {
+        const uint8_t *data = static_cast<const uint8_t*>(bytes);
+        for (std::size_t i = 0; i < length; ++i) {
+            hash ^= data[i];
+            hash *= 0x100000001b3ULL;
+        }
+        return hash;
+    }
+
+    uint64_t waitlist_key(uint32_t event_id, uint8_t category) noexcept {
+        return static_cast<uint64_t>(event_id) << 8 | category;
+    }
+
+#if defined(__x86_64__)
+    // Gathers `values[id]` for eight IDs at a time, with 0 for IDs not
+    // below `size`. Returns the number of IDs processed.
+    __attribute__((target("avx2")))
+    std::size_t gather_ticket_counts(const uint32_t *values, uint32_t size,
+                                     const uint32_t *event_ids, std::size_t count,
+                                     uint32_t *result) noexcept
+    {
+        const __m256i sign = _mm256_set1_epi32(INT_MIN);
+        const __m256i limit = _mm256_xor_si256(_mm256_set1_epi32(size), sign);
+
+        std::size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            const __m256i ids = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(event_ids + i));
+            // Unsigned ids < size, lanes of invalid IDs are not loaded.
+            const __m256i valid = _mm256_cmpgt_epi32(limit, _mm256_xor_si256(ids, sign));
+            const __m256i counts = _mm256_mask_i32gather_epi32(
+                _mm256_setzero_si256(), reinterpret_cast<const int*>(values), ids, valid, 4
+            );
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(result + i), counts);
+        }
+        return i;
+    }
+#endif
+}
+
+
+Database::Database(uint64_t timeout_, const Clock &clock_, uint64_t ticket_key_)
 : timeout{timeout_}
+, clock{clock_}
 , next_reservation_id{MIN_RESERVATION_ID}
+, next_ticket{0}
+, ticket_key{ticket_key_}
+, ticket_cipher{ticket_key_}
+, collected_count{0}
+, catalog_version{0}
+, dirty_counters{false} {}
+
+Database::Database(Database &&other) = default;
+
+Database::~Database() = default;
+
+void Database::add_event(std::string &&description, uint32_t ticket_count) {
+    add_event(std::move(description), ticket_count, events.size());
+}
+
+void Database::add_event(const std::string &description, uint32_t ticket_count) {
+    add_event(description, ticket_count, events.size());
+}
+
+void Database::add_event(std::string &&description, uint32_t ticket_count,
+                         uint64_t external_id)
 {
-    memset(base_ticket, '0', TICKET_LEN);
+    add_event(std::move(description), std::vector<uint32_t>{ticket_count}, external_id);
 }
 
-void Database::add_event(std::string &&description, uint16_t ticket_count) {
-    events.push_back(Event(events.size(), std::move(description), ticket_count));
+void Database::add_event(const std::string &description, uint32_t ticket_count,
+                         uint64_t external_id)
+{
+    add_event(description, std::vector<uint32_t>{ticket_count}, external_id);
 }
 
-void Database::add_event(const std::string &description, uint16_t ticket_count) {
-    events.push_back(Event(events.size(), description, ticket_count));
+// can throw
+void Database::add_event(std::string &&description, const std::vector<uint32_t> &counts,
+                         uint64_t external_id)
+{
+    if (counts.empty() || counts.size() > MAX_CATEGORIES)
+        throw InvalidCategory();
+    events.push_back(Event(events.size(), external_id, std::move(description), counts.size()));
+    add_counts(counts);
 }
 
 // can throw
-Reservation Database::make_reservation(uint32_t event_id, uint16_t ticket_count) {
-    if (!ticket_count)
-        throw InvalidTicketCount();
+void Database::add_event(const std::string &description, const std::vector<uint32_t> &counts,
+                         uint64_t external_id)
+{
+    if (counts.empty() || counts.size() > MAX_CATEGORIES)
+        throw InvalidCategory();
+    events.push_back(Event(events.size(), external_id, description, counts.size()));
+    add_counts(counts);
+}
+
+// can throw
+void Database::index_events() {
+    set_indexes(build_indexes(events));
+}
+
+// can throw
+EventIndexes Database::build_indexes(const std::vector<Event> &events) {
+    EventIndexer indexer;
+    for (const auto &event : events)
+        indexer.add(event.external_id, event.description, event.category_count);
+    return indexer.build();
+}
+
+void Database::set_indexes(EventIndexes &&indexes) noexcept {
+    external_ids = std::move(indexes.external_ids);
+    description_index = std::move(indexes.descriptions);
+    catalog_version = indexes.catalog_version;
+}
+
+// can throw
+uint32_t Database::find_event(uint64_t external_id) const {
+    const uint32_t event_id = external_ids.find(external_id);
+    if (event_id == PerfectHash::NOT_FOUND)
+        throw EventNotFound();
+    return event_id;
+}
+
+// can throw
+const Event &Database::get_event(uint32_t event_id) const {
+    if (event_id >= events.size())
+        throw EventNotFound();
+    return events[event_id];
+}
+
+// can throw
+uint32_t Database::available_tickets(uint32_t event_id, uint8_t category) const {
+    if (event_id >= events.size())
+        throw EventNotFound();
+    if (category >= MAX_CATEGORIES)
+        throw InvalidCategory();
+    return ticket_counts[category][event_id];
+}
+
+void Database::get_ticket_counts(const uint32_t *event_ids, std::size_t size,
+                                 uint32_t *result) const noexcept
+{
+    const std::vector<uint32_t> &counts = ticket_counts[0];
+    std::size_t i = 0;
+#if defined(__x86_64__)
+    if (!counts.empty() && counts.size() <= INT32_MAX && __builtin_cpu_supports("avx2"))
+        i = gather_ticket_counts(counts.data(), counts.size(), event_ids, size, result);
+#endif
+    for (; i < size; ++i)
+        result[i] = (event_ids[i] < counts.size()) ? counts[event_ids[i]] : 0;
+}
+
+// can throw
+std::size_t Database::search_events(std::string_view query, std::size_t max_results,
+                                    std::vector<uint32_t> &result) const
+{
+    if (query.size() < TrigramIndex::MIN_QUERY_LENGTH)
+        throw QueryTooShort();
+
+    std::size_t match_count = 0;
+    std::vector<uint32_t> candidates;
+    description_index.candidates(query, candidates);
+    result.clear();
+    for (const uint32_t event_id : candidates) {
+        if (!TrigramIndex::contains(events[event_id].description, query))
+            continue;
+        if (match_count++ < max_results)
+            result.push_back(event_id);
+    }
+    return match_count;
+}
+
+std::size_t Database::live_reservations() const noexcept {
+    return reservations.size() - collected_count;
+}
+
+std::size_t Database::collected_reservations() const noexcept {
+    return collected_count;
+}
+
+std::size_t Database::pending_expirations() const noexcept {
+    return reservation_queue.size();
+}
+
+// can throw
+Reservation Database::make_reservation(uint32_t event_id, uint16_t ticket_count,
+                                       uint8_t category)
+{
     if (ticket_count > MAX_TICKET_COUNT)
         throw TooManyTickets();
+    clean_queue();
+    return reserve(event_id, ticket_count, category);
+}
+
+// can throw
+Reservation Database::make_large_reservation(uint32_t event_id, uint32_t ticket_count,
+                                             uint8_t category)
+{
+    clean_queue();
+    return reserve(event_id, ticket_count, category);
+}
+
+// can throw
+Reservation Database::reserve(uint32_t event_id, uint32_t ticket_count, uint8_t category) {
+    if (!ticket_count)
+        throw InvalidTicketCount();
     if (event_id >= events.size())
         throw EventNotFound();
-    if (events[event_id].ticket_count < ticket_count)
+    if (category >= events[event_id].category_count)
+        throw InvalidCategory();
+    if (ticket_counts[category][event_id] < ticket_count)
         throw TicketShortage();
         
-    const uint64_t expiration_time = get_seconds_from_epoch() + timeout;
+    const uint64_t expiration_time = clock.now() + timeout;
     const uint32_t reservation_id = get_reservation_id();
-    events[event_id].ticket_count -= ticket_count;
+    ticket_counts[category][event_id] -= ticket_count;
+    mark_event(event_id);
+    mark_reservation(reservation_id);
 
-    Reservation result(reservation_id, event_id, ticket_count, expiration_time);
+    Reservation result(reservation_id, event_id, ticket_count, category, expiration_time);
     ReservationInfo info(result);
     generate_tickets(info, ticket_count);
 
@@ -236,24 +483,274 @@ Reservation Database::make_reservation(uint32_t event_id, uint16_t ticket_count)
 // can throw
 [[nodiscard]] std::vector<Ticket>
 Database::get_tickets(uint32_t reservation_id, char const *cookie) {
+    auto &reservation = find_reservation(reservation_id, cookie);
+    if (reservation.ticket_count > MAX_TICKET_COUNT)
+        throw TooManyTickets();
+    auto tickets = make_tickets(reservation, 0, reservation.ticket_count);
+    collect(reservation_id, reservation);
+    return tickets;
+}
+
+// can throw
+[[nodiscard]] std::vector<Ticket>
+Database::get_ticket_chunk(uint32_t reservation_id, char const *cookie, uint32_t chunk) {
+    auto &reservation = find_reservation(reservation_id, cookie);
+    const uint64_t first = static_cast<uint64_t>(chunk) * TICKETS_PER_CHUNK;
+    if (first >= reservation.ticket_count)
+        throw InvalidChunk();
+    const uint32_t count = std::min<uint64_t>(TICKETS_PER_CHUNK, reservation.ticket_count - first);
+    auto tickets = make_tickets(reservation, first, count);
+    collect(reservation_id, reservation);
+    return tickets;
+}
+
+// can throw
+[[nodiscard]] std::vector<TicketRange>
+Database::get_ticket_ranges(uint32_t reservation_id, char const *cookie) {
+    if (ticket_cipher.enabled())
+        throw TicketsNotConsecutive();
+    auto &reservation = find_reservation(reservation_id, cookie);
+
+    // Codes are the counter values themselves, modulo the code space.
+    std::vector<TicketRange> ranges;
+    const uint64_t first = reservation.first_ticket % TicketCipher::DOMAIN_SIZE;
+    const uint64_t before_wrap = TicketCipher::DOMAIN_SIZE - first;
+    uint32_t count = std::min<uint64_t>(reservation.ticket_count, before_wrap);
+    ranges.push_back(TicketRange{{}, count});
+    TicketCipher::encode(first, ranges.back().first.code);
+    if (count < reservation.ticket_count) {
+        ranges.push_back(TicketRange{{}, reservation.ticket_count - count});
+        TicketCipher::encode(0, ranges.back().first.code);
+    }
+    collect(reservation_id, reservation);
+    return ranges;
+}
+
+// can throw
+// Does not change the reservation, so that requests failing later
+// validation leave it uncollected.
+Database::ReservationInfo &Database::find_reservation(uint32_t reservation_id,
+                                                      char const *cookie)
+{
     clean_queue();
-        
-    try {
-        auto &reservation = reservations.at(reservation_id);
-        if (!cmp_cookies(cookie, reservation.cookie))
-            throw InvalidCookie();
-
-        reservation.received = true;
-        std::vector<Ticket> result(reservation.ticket_count);
-        memcpy(result[0].code, reservation.ticket_min, TICKET_LEN);
-        for (uint16_t i = 1; i < reservation.ticket_count; ++i) {
-            memcpy(result[i].code, result[i - 1].code, TICKET_LEN);
-            increase_ticket(result[i].code, 1);
-        }
-        return result;
-    } catch (std::out_of_range&) {
+
+    auto it = reservations.find(reservation_id);
+    if (it == reservations.end())
         throw ReservationNotFound();
+    auto &reservation = it->second;
+    if (!cmp_cookies(cookie, reservation.cookie))
+        throw InvalidCookie();
+    return reservation;
+}
+
+void Database::collect(uint32_t reservation_id, ReservationInfo &reservation) {
+    if (reservation.received)
+        return;
+    sold_tickets.emplace(reservation.first_ticket, reservation.ticket_count);
+    reservation.received = true;
+    ++collected_count;
+    mark_reservation(reservation_id);
+    sales.push_back(Sale{
+        reservation_id, reservation.event_id, reservation.category,
+        reservation.first_ticket, reservation.ticket_count,
+        reservation.expiration_time - timeout, clock.now()
+    });
+}
+
+std::vector<Ticket> Database::make_tickets(const ReservationInfo &reservation,
+                                           uint64_t first, uint32_t count) const
+{
+    // No dependencies between iterations, so they overlap in the pipeline.
+    std::vector<Ticket> result(count);
+    const uint64_t base = reservation.first_ticket + first;
+    for (uint32_t i = 0; i < count; ++i)
+        TicketCipher::encode(ticket_cipher.encrypt((base + i) % TicketCipher::DOMAIN_SIZE),
+                             result[i].code);
+    return result;
+}
+
+// can throw
+std::size_t Database::join_waitlist(uint64_t client, uint32_t event_id,
+                                    uint16_t ticket_count, uint8_t category)
+{
+    if (!ticket_count)
+        throw InvalidTicketCount();
+    if (ticket_count > MAX_TICKET_COUNT)
+        throw TooManyTickets();
+    if (event_id >= events.size())
+        throw EventNotFound();
+    if (category >= events[event_id].category_count)
+        throw InvalidCategory();
+
+    clean_queue();
+
+    auto entries = client_waitlists.find(client);
+    if (entries != client_waitlists.end() && entries->second >= MAX_CLIENT_WAITLISTS)
+        throw TooManyWaitlists();
+
+    const uint64_t key = waitlist_key(event_id, category);
+    auto &waitlist = waitlists[key];
+    if (waitlist.size() >= MAX_WAITLIST_LENGTH)
+        throw WaitlistFull();
+    waitlist.emplace_back(client, ticket_count);
+    ++client_waitlists[client];
+    const std::size_t position = waitlist.size() - 1;
+    const std::size_t queued = waitlist.size();
+
+    // The tickets may have been returned in the meantime.
+    serve_waitlist(event_id, category);
+    auto it = waitlists.find(key);
+    const std::size_t served = queued - ((it == waitlists.end()) ? 0 : it->second.size());
+    return (served > position) ? 0 : position - served;
+}
+
+void Database::expire_reservations() noexcept {
+    clean_queue();
+}
+
+void Database::take_allocations(std::vector<Allocation> &result) {
+    result.clear();
+    result.swap(allocations);
+}
+
+void Database::take_sales(std::vector<Sale> &result) {
+    result.clear();
+    result.swap(sales);
+}
+
+// Reservation pages list the reservations that exist, so restoring one
+// also drops those removed since an older version of the page was taken.
+void Database::take_dirty_pages(std::vector<StatePage> &pages, bool all) {
+    if (all) {
+        dirty_counters = true;
+        for (uint32_t page = 0; page * EVENTS_PER_PAGE < events.size(); ++page)
+            dirty_events.mark(page);
+        for (uint32_t page = 0;
+             page * RESERVATIONS_PER_PAGE < next_reservation_id - MIN_RESERVATION_ID; ++page)
+            dirty_reservations.mark(page);
     }
+
+    if (dirty_counters) {
+        StatePage page{StatePage::COUNTERS, 0, {}};
+        put(page.data, next_reservation_id);
+        put(page.data, next_ticket);
+        put(page.data, ticket_key);
+        pages.push_back(std::move(page));
+        dirty_counters = false;
+    }
+
+    for (const uint32_t index : dirty_events.list) {
+        StatePage page{StatePage::EVENTS, index, {}};
+        const uint32_t first = index * EVENTS_PER_PAGE;
+        const uint32_t last = std::min<std::size_t>(first + EVENTS_PER_PAGE, events.size());
+        for (uint32_t event_id = first; event_id < last; ++event_id)
+            for (uint8_t category = 0; category < MAX_CATEGORIES; ++category)
+                put(page.data, ticket_counts[category][event_id]);
+        pages.push_back(std::move(page));
+        dirty_events.bits[index] = false;
+    }
+    dirty_events.list.clear();
+
+    for (const uint32_t index : dirty_reservations.list) {
+        StatePage page{StatePage::RESERVATIONS, index, {}};
+        const uint32_t first = MIN_RESERVATION_ID + index * RESERVATIONS_PER_PAGE;
+        for (uint32_t id = first; id < first + RESERVATIONS_PER_PAGE; ++id) {
+            auto it = reservations.find(id);
+            if (it == reservations.end())
+                continue;
+            const auto &reservation = it->second;
+            put(page.data, id);
+            put(page.data, reservation.event_id);
+            put(page.data, reservation.ticket_count);
+            put(page.data, reservation.category);
+            put(page.data, reservation.first_ticket);
+            put(page.data, reservation.expiration_time);
+            put(page.data, static_cast<uint8_t>(reservation.received));
+        }
+        pages.push_back(std::move(page));
+        dirty_reservations.bits[index] = false;
+    }
+    dirty_reservations.list.clear();
+}
+
+// can throw
+// Reservations come back in the order of their IDs, and thus of their
+// expiration times.
+void Database::restore_page(const StatePage &page) {
+    std::string_view data = page.data;
+    switch (page.kind) {
+        case StatePage::COUNTERS:
+            next_reservation_id = get<uint32_t>(data);
+            next_ticket = get<uint64_t>(data);
+            ticket_key = get<uint64_t>(data);
+            ticket_cipher = TicketCipher(ticket_key);
+            break;
+        case StatePage::EVENTS: {
+            const std::size_t first = std::size_t{page.index} * EVENTS_PER_PAGE;
+            const std::size_t count = data.size() / (MAX_CATEGORIES * sizeof(uint32_t));
+            if (first + count > events.size())
+                throw InvalidStatePage();
+            for (std::size_t event_id = first; event_id < first + count; ++event_id)
+                for (uint8_t category = 0; category < MAX_CATEGORIES; ++category)
+                    ticket_counts[category][event_id] = get<uint32_t>(data);
+            break;
+        }
+        case StatePage::RESERVATIONS:
+            while (!data.empty()) {
+                const uint32_t reservation_id = get<uint32_t>(data);
+                const uint32_t event_id = get<uint32_t>(data);
+                const uint32_t ticket_count = get<uint32_t>(data);
+                const uint8_t category = get<uint8_t>(data);
+                const uint64_t first_ticket = get<uint64_t>(data);
+                const uint64_t expiration_time = get<uint64_t>(data);
+                const bool received = get<uint8_t>(data);
+                if (event_id >= events.size() || category >= events[event_id].category_count)
+                    throw InvalidStatePage();
+
+                // Cookies follow from the reservation ID.
+                ReservationInfo info(Reservation(reservation_id, event_id, ticket_count,
+                                                 category, expiration_time));
+                info.first_ticket = first_ticket;
+                info.received = received;
+                reservations.emplace(reservation_id, info);
+                if (received) {
+                    sold_tickets.emplace(first_ticket, ticket_count);
+                    ++collected_count;
+                } else {
+                    reservation_queue.push(ReservationTime(reservation_id, expiration_time));
+                }
+            }
+            break;
+        default:
+            throw InvalidStatePage();
+    }
+    if (!data.empty())
+        throw InvalidStatePage();
+}
+
+bool Database::restorable(const StatePage &page) const noexcept {
+    if (catalog_version || page.kind == StatePage::COUNTERS)
+        return true;
+    if (page.kind != StatePage::EVENTS)
+        return false;
+    const std::size_t count = page.data.size() / (MAX_CATEGORIES * sizeof(uint32_t));
+    return std::size_t{page.index} * EVENTS_PER_PAGE + count <= events.size();
+}
+
+// A single inverse permutation and a lookup of the reservation the ticket
+// was issued for, so that tickets of expired reservations are not valid.
+// Codes of counters past TicketCipher::DOMAIN_SIZE repeat earlier ones;
+// only the earlier tickets are recognized.
+bool Database::validate_ticket(char const *code) const noexcept {
+    const uint64_t value = TicketCipher::decode(code);
+    if (value >= TicketCipher::DOMAIN_SIZE)
+        return false;
+    const uint64_t ticket = ticket_cipher.decrypt(value);
+    auto it = sold_tickets.upper_bound(ticket);
+    if (it == sold_tickets.begin())
+        return false;
+    --it;
+    return ticket - it->first < it->second;
 }
 
 // can throw
@@ -268,15 +765,20 @@ void Database::remove_reservation(const uint32_t reservation_id) noexcept {
         const auto &record = reservations.at(reservation_id);
         if (record.received)
             return;
-        events[record.event_id].ticket_count += record.ticket_count;
+        const uint32_t event_id = record.event_id;
+        const uint8_t category = record.category;
+        ticket_counts[category][event_id] += record.ticket_count;
         reservations.erase(reservation_id);
+        mark_event(event_id);
+        mark_reservation(reservation_id);
+        serve_waitlist(event_id, category);
     } catch (...) {
         // ignore
     }
 }
 
 void Database::clean_queue() noexcept {
-    const uint64_t current_time = get_seconds_from_epoch();
+    const uint64_t current_time = clock.now();
     while (!reservation_queue.empty()) {
         auto &top = reservation_queue.front();
         if (top.expiration_time < current_time) {
@@ -288,8 +790,99 @@ void Database::clean_queue() noexcept {
     }
 }
 
-void Database::generate_tickets(ReservationInfo &reservation, uint16_t ticket_count) noexcept {
-    memcpy(reservation.ticket_min, base_ticket, TICKET_LEN);
-    increase_ticket(base_ticket, ticket_count);
+// Strictly first come, first served: a waiter that cannot be satisfied
+// blocks the ones behind it.
+void Database::serve_waitlist(uint32_t event_id, uint8_t category) noexcept {
+    auto it = waitlists.find(waitlist_key(event_id, category));
+    if (it == waitlists.end())
+        return;
+
+    auto &waitlist = it->second;
+    while (!waitlist.empty()
+           && waitlist.front().ticket_count <= ticket_counts[category][event_id])
+    {
+        const Waiter waiter = waitlist.front();
+        try {
+            allocations.push_back(Allocation{
+                waiter.client, reserve(event_id, waiter.ticket_count, category)
+            });
+        } catch (...) {
+            break;
+        }
+        waitlist.pop_front();
+        auto entries = client_waitlists.find(waiter.client);
+        if (--entries->second == 0)
+            client_waitlists.erase(entries);
+    }
+
+    if (waitlist.empty())
+        waitlists.erase(it);
+}
+
+void Database::generate_tickets(ReservationInfo &reservation, uint32_t ticket_count) noexcept {
+    reservation.first_ticket = next_ticket;
+    next_ticket += ticket_count;
+}
+
+// can throw
+// Every category gets a count, so that all the arrays stay as long as
+// the events.
+void Database::add_counts(const std::vector<uint32_t> &counts) {
+    for (uint8_t category = 0; category < MAX_CATEGORIES; ++category)
+        ticket_counts[category].push_back((category < counts.size()) ? counts[category] : 0);
+}
+
+void Database::mark_event(uint32_t event_id) {
+    dirty_events.mark(event_id / EVENTS_PER_PAGE);
+}
+
+// Also marks the counters, which change with every new reservation.
+void Database::mark_reservation(uint32_t reservation_id) {
+    dirty_counters = true;
+    dirty_reservations.mark((reservation_id - MIN_RESERVATION_ID) / RESERVATIONS_PER_PAGE);
+}
+
+
+
+///////////////////////////
+///                     ///
+///    EVENT INDEXER    ///
+///                     ///
+///////////////////////////
+
+
+EventIndexer::EventIndexer() noexcept
+: m_hash{0xcbf29ce484222325ULL} {}
+
+// The catalog version is a hash of what CATALOG replies describe, so that
+// it survives restarts with the same events file.
+void EventIndexer::add(uint64_t external_id, std::string_view description,
+                       uint8_t category_count)
+{
+    const uint8_t length = description.length();
+    m_external_ids.push_back(external_id);
+    m_descriptions.add(description);
+    m_hash = fnv1a(&external_id, sizeof(external_id), m_hash);
+    m_hash = fnv1a(&category_count, sizeof(category_count), m_hash);
+    m_hash = fnv1a(&length, sizeof(length), m_hash);
+    m_hash = fnv1a(description.data(), length, m_hash);
 }
 
+// can throw
+// 0 is left for a catalog that has not been indexed yet.
+EventIndexes EventIndexer::build() {
+    EventIndexes indexes;
+    const bool unique = indexes.external_ids.build(m_external_ids);
+    m_external_ids.clear();
+    if (!unique)
+        throw DuplicateEventID();
+    m_descriptions.finish();
+    indexes.descriptions = std::move(m_descriptions);
+    m_descriptions = TrigramIndex();
+
+    indexes.catalog_version = static_cast<uint32_t>(m_hash ^ m_hash >> 32);
+    if (!indexes.catalog_version)
+        indexes.catalog_version = 1;
+    m_hash = 0xcbf29ce484222325ULL;
+    return indexes;
+}
@@ -2,12 +2,19 @@
 #define __TICKET_DATABASE_H__
 
 #include "common.h"
+#include "clock.h"
+#include "perfect_hash.h"
+#include "ticket_cipher.h"
+#include "trigram_index.h"
 
 #include <cstdint>
 #include <exception>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
+#include <deque>
+#include <map>
 #include <queue>
 
 //////////////////////////
@@ -18,6 +25,12 @@
 
 
 constexpr int COOKIE_LEN = 48;
+// Ticket categories (price tiers) per event.
+constexpr uint8_t MAX_CATEGORIES = 8;
+// Clients waiting for a single event and ticket category.
+constexpr std::size_t MAX_WAITLIST_LENGTH = 1 << 16;
+// Waitlist entries of a single client, across all events.
+constexpr std::size_t MAX_CLIENT_WAITLISTS = 16;
 
 
 ///////////////////////////
@@ -47,6 +60,10 @@ class TooManyTickets : public std::exception {
     virtual const char *what() const noexcept;
 };
 
+class InvalidChunk : public std::exception {
+    virtual const char *what() const noexcept;
+};
+
 class InvalidReservationID : public std::exception {
     virtual const char *what() const noexcept;
 };
@@ -55,6 +72,34 @@ class InvalidCookie : public std::exception {
     virtual const char *what() const noexcept;
 };
 
+class InvalidCategory : public std::exception {
+    virtual const char *what() const noexcept;
+};
+
+class WaitlistFull : public std::exception {
+    virtual const char *what() const noexcept;
+};
+
+class TooManyWaitlists : public std::exception {
+    virtual const char *what() const noexcept;
+};
+
+class DuplicateEventID : public std::exception {
+    virtual const char *what() const noexcept;
+};
+
+class QueryTooShort : public std::exception {
+    virtual const char *what() const noexcept;
+};
+
+class TicketsNotConsecutive : public std::exception {
+    virtual const char *what() const noexcept;
+};
+
+class InvalidStatePage : public std::exception {
+    virtual const char *what() const noexcept;
+};
+
 
 ///////////////////////////
 ///                     ///
@@ -64,26 +109,60 @@ class InvalidCookie : public std::exception {
 ///////////////////////////
 
 
+// Ticket counts are kept by the Database, see Database::available_tickets().
 struct Event {
     uint32_t            event_id;
+    uint64_t            external_id; // ID in the upstream catalog
     const std::string   description;
-    uint16_t            ticket_count;
+    uint8_t             category_count;
 
-    Event(uint32_t event_id_, std::string &&description_, uint16_t ticket_count_);
-    Event(uint32_t event_id_, const std::string &description_, uint16_t ticket_count_);
+    Event(uint32_t event_id_, uint64_t external_id_,
+          std::string &&description_, uint8_t category_count_);
+    Event(uint32_t event_id_, uint64_t external_id_,
+          const std::string &description_, uint8_t category_count_);
     ~Event() = default;
 };
 
+// What index_events() builds over the events. Building it takes a while
+// for a large catalog, so it can also be built apart from the database
+// (e.g. on another thread) with build_indexes() and swapped in.
+struct EventIndexes {
+    PerfectHash     external_ids;
+    TrigramIndex    descriptions;
+    uint32_t        catalog_version = 0;
+};
+
+// Builds EventIndexes from events added one at a time, in the order of
+// their IDs, so that the events need not be kept until the last one has
+// been added (see CatalogLoader).
+class EventIndexer {
+private:
+    std::vector<uint64_t>   m_external_ids;
+    TrigramIndex            m_descriptions;
+    uint64_t                m_hash;
+
+public:
+    EventIndexer() noexcept;
+    ~EventIndexer() = default;
+
+    void add(uint64_t external_id, std::string_view description, uint8_t category_count);
+
+    // can throw
+    // Leaves the indexer as if just created.
+    EventIndexes build();
+};
+
 struct Reservation {
     uint32_t    reservation_id;
     uint32_t    event_id;
-    uint16_t    ticket_count;
+    uint32_t    ticket_count;
+    uint8_t     category;
     char        cookie[COOKIE_LEN];
     uint64_t    expiration_time;
 
     Reservation() = delete;
-    Reservation(uint32_t reservation_id_, uint32_t event_id_,
-                uint16_t ticket_count_, uint64_t expiration_time_);
+    Reservation(uint32_t reservation_id_, uint32_t event_id_, uint32_t ticket_count_,
+                uint8_t category_, uint64_t expiration_time_);
 
 private:
     void generate_cookie();
@@ -93,6 +172,48 @@ struct Ticket {
     char code[TICKET_LEN];
 };
 
+// `count` tickets with consecutive codes, starting with `first`.
+struct TicketRange {
+    Ticket      first;
+    uint32_t    count;
+};
+
+// A reservation made on behalf of a waitlisted client.
+struct Allocation {
+    uint64_t    client;
+    Reservation reservation;
+};
+
+// A reservation collected for the first time. Its tickets are those with
+// counter values [first_ticket, first_ticket + ticket_count).
+struct Sale {
+    uint32_t    reservation_id;
+    uint32_t    event_id;
+    uint8_t     category;
+    uint64_t    first_ticket;
+    uint32_t    ticket_count;
+    uint64_t    reservation_time;
+    uint64_t    collection_time;
+};
+
+// A part of the state that has to outlive the process (see
+// Database::take_dirty_pages()), in a format private to the Database.
+struct StatePage {
+    enum Kind : uint8_t {
+        COUNTERS = 0,       // a single page
+        EVENTS = 1,         // ticket counts of consecutive events
+        RESERVATIONS = 2    // reservations with consecutive IDs
+    };
+
+    static constexpr std::size_t MAX_SIZE = 8192; // of the data
+    // Of the events whose ticket counts an EVENTS page holds.
+    static constexpr uint32_t EVENTS_PER_PAGE = 256;
+
+    uint8_t     kind;
+    uint32_t    index;
+    std::string data;
+};
+
 
 ///////////////////////////
 ///                     ///
@@ -106,6 +227,23 @@ class Database {
 private:
     struct ReservationInfo;
     struct ReservationTime;
+    struct Waiter;
+
+    // Pages changed since they were last taken: the bitmap keeps every
+    // page listed once, the list saves scanning the bitmap.
+    struct DirtyPages {
+        std::vector<bool>       bits;
+        std::vector<uint32_t>   list;
+
+        void mark(uint32_t page) {
+            if (page >= bits.size())
+                bits.resize(page + 1);
+            if (!bits[page]) {
+                bits[page] = true;
+                list.push_back(page);
+            }
+        }
+    };
 
 public:
     class event_iterator : public std::vector<Event>::const_iterator {
@@ -119,20 +257,104 @@ public:
 /* Fields */
 private:
     const uint64_t                                  timeout;
+    const Clock                                    &clock;
     std::vector<Event>                              events;
+    // Ticket counts by category, each indexed by event ID (0 for the
+    // categories an event does not have).
+    std::vector<uint32_t>                           ticket_counts[MAX_CATEGORIES];
+    PerfectHash                                     external_ids;
+    TrigramIndex                                    description_index;
     std::unordered_map<uint32_t, ReservationInfo>   reservations;
     std::queue<ReservationTime>                     reservation_queue;
+    // FIFO per (event ID, category), see waitlist_key()
+    std::unordered_map<uint64_t, std::deque<Waiter>> waitlists;
+    // Entries in the waitlists per client
+    std::unordered_map<uint64_t, std::size_t>       client_waitlists;
+    std::vector<Allocation>                         allocations;
+    std::vector<Sale>                               sales;
     uint32_t                                        next_reservation_id;
-    char                                            base_ticket[TICKET_LEN];
+    // Tickets issued so far; codes are the cipher's images of the counter.
+    uint64_t                                        next_ticket;
+    uint64_t                                        ticket_key;
+    TicketCipher                                    ticket_cipher;
+    std::size_t                                     collected_count;
+    // First ticket (counter value) of every collected reservation, mapped
+    // to its ticket count.
+    std::map<uint64_t, uint32_t>                    sold_tickets;
+    uint32_t                                        catalog_version;
+    bool                                            dirty_counters;
+    DirtyPages                                      dirty_events;
+    DirtyPages                                      dirty_reservations;
 
 /* Methods */
 public:
     Database() = delete;
-    Database(uint64_t timeout_);
-    ~Database() = default;
+    // A nonzero `ticket_key_` makes ticket codes unguessable; with 0 they
+    // are consecutive. Restored state brings its own key, see restore_page().
+    Database(uint64_t timeout_, const Clock &clock_ = SystemClock::instance(),
+             uint64_t ticket_key_ = 0);
+    Database(Database &&other);
+    ~Database();
+
+    // Events added without an external ID use their (dense) event ID.
+    void add_event(std::string &&description, uint32_t ticket_count);
+    void add_event(const std::string &description, uint32_t ticket_count);
+    void add_event(std::string &&description, uint32_t ticket_count, uint64_t external_id);
+    void add_event(const std::string &description, uint32_t ticket_count, uint64_t external_id);
+    // can throw
+    // One count per ticket category, starting with category 0.
+    void add_event(std::string &&description, const std::vector<uint32_t> &counts,
+                   uint64_t external_id);
+    // can throw
+    void add_event(const std::string &description, const std::vector<uint32_t> &counts,
+                   uint64_t external_id);
 
-    void add_event(std::string &&description, uint16_t ticket_count);
-    void add_event(const std::string &description, uint16_t ticket_count);
+    // can throw
+    // Has to be called after the last event has been added
+    // for find_event() to see all of them. Sets the catalog version.
+    void index_events();
+
+    // can throw
+    // The indexes index_events() would build for `events`. Touches no
+    // database, so it may run on any thread.
+    static EventIndexes build_indexes(const std::vector<Event> &events);
+
+    // Does what index_events() does, with indexes built by build_indexes()
+    // (or an EventIndexer) from the same events as the database's.
+    void set_indexes(EventIndexes &&indexes) noexcept;
+
+    // Derived from the events and their descriptions, so clients can
+    // cache descriptions keyed by it. 0 until the events are indexed.
+    uint32_t get_catalog_version() const noexcept {
+        return catalog_version;
+    }
+
+    // can throw
+    uint32_t find_event(uint64_t external_id) const;
+
+    // can throw
+    const Event &get_event(uint32_t event_id) const;
+
+    std::size_t event_count() const noexcept {
+        return events.size();
+    }
+
+    // can throw
+    uint32_t available_tickets(uint32_t event_id, uint8_t category = 0) const;
+
+    // Stores the ticket counts (category 0) of the given events in
+    // `result`, or 0 for IDs of events that do not exist.
+    void get_ticket_counts(const uint32_t *event_ids, std::size_t size,
+                           uint32_t *result) const noexcept;
+
+    // can throw
+    // Finds the events whose descriptions contain `query` (ignoring ASCII
+    // case). Returns the number of matches and stores the IDs of at most
+    // `max_results` of them in `result`. Queries shorter than
+    // TrigramIndex::MIN_QUERY_LENGTH would need a scan of every event,
+    // so they are rejected.
+    std::size_t search_events(std::string_view query, std::size_t max_results,
+                              std::vector<uint32_t> &result) const;
 
     event_iterator events_begin() const noexcept {
         return events.cbegin();
@@ -142,17 +364,106 @@ public:
         return events.cend();
     }
 
+    // Reservations whose tickets have not been collected yet (including
+    // the expired ones still waiting in the queue).
+    std::size_t live_reservations() const noexcept;
+    // Collected reservations are never removed.
+    std::size_t collected_reservations() const noexcept;
+    std::size_t pending_expirations() const noexcept;
+
+    // can throw
+    Reservation make_reservation(uint32_t event_id, uint16_t ticket_count, uint8_t category = 0);
     // can throw
-    Reservation make_reservation(uint32_t event_id, uint16_t ticket_count);
+    // Reservations above MAX_TICKET_COUNT can only be collected in chunks.
+    Reservation make_large_reservation(uint32_t event_id, uint32_t ticket_count,
+                                       uint8_t category = 0);
     // can throw
     [[nodiscard]] std::vector<Ticket> get_tickets(uint32_t reservation_id, char const *cookie);
+    // can throw
+    // Tickets [chunk * TICKETS_PER_CHUNK, (chunk + 1) * TICKETS_PER_CHUNK)
+    // of the reservation, generated on demand.
+    [[nodiscard]] std::vector<Ticket> get_ticket_chunk(uint32_t reservation_id,
+                                                       char const *cookie, uint32_t chunk);
+    // can throw
+    // The reservation's tickets as ranges of consecutive codes (two if the
+    // counter wrapped around), for reservations of any size. Only codes
+    // issued without a ticket key are consecutive; with one, this throws
+    // TicketsNotConsecutive and leaves the reservation uncollected.
+    [[nodiscard]] std::vector<TicketRange> get_ticket_ranges(uint32_t reservation_id,
+                                                             char const *cookie);
+
+    // can throw
+    // Queues `client` (an opaque identifier chosen by the caller) for
+    // tickets of the event. Whenever tickets of the category become
+    // available, they are reserved for the waiters in order; the resulting
+    // reservations are handed out by take_allocations(). Returns the number
+    // of waiters ahead of the client (0 also if it has been served already).
+    // A client can wait in at most MAX_CLIENT_WAITLISTS places at a time.
+    std::size_t join_waitlist(uint64_t client, uint32_t event_id,
+                              uint16_t ticket_count, uint8_t category = 0);
+
+    // Replaces the contents of `result` with the reservations made for
+    // waiters since the last call, keeping its storage as take_sales() does.
+    void take_allocations(std::vector<Allocation> &result);
+
+    // Replaces the contents of `result` with the reservations collected
+    // since the last call. The storage of `result` is kept for the next
+    // ones, so a caller that passes the same vector every time does not
+    // allocate.
+    void take_sales(std::vector<Sale> &result);
+
+    uint64_t get_ticket_key() const noexcept {
+        return ticket_key;
+    }
+
+    // Whether `code` (TICKET_LEN characters) is the code of a ticket of a
+    // collected reservation.
+    bool validate_ticket(char const *code) const noexcept;
+
+    // Appends the pages changed since the last call (or all of them) to
+    // `pages`. Waitlists are not included: their clients are gone once the
+    // process is.
+    void take_dirty_pages(std::vector<StatePage> &pages, bool all = false);
+
+    // can throw
+    // Loads a page taken from a database with the same events. Every page
+    // may be restored only once, before any reservation is made. The
+    // counters page also brings the ticket key, which replaces the one
+    // the database was created with: the codes of the restored tickets
+    // were derived from it.
+    void restore_page(const StatePage &page);
+
+    // Whether the events `page` refers to have been added, so that it can
+    // be restored: its own for ticket counts, every event (the catalog
+    // has been indexed) for the other kinds. Once the catalog has been
+    // indexed, restore_page() tells whether they match.
+    bool restorable(const StatePage &page) const noexcept;
+
+    // Returns the tickets of expired reservations (and serves the
+    // waitlists). Done implicitly by the reserving and collecting methods;
+    // callers about to read ticket counts should do it explicitly.
+    void expire_reservations() noexcept;
 
 private:
     // can throw
+    Reservation reserve(uint32_t event_id, uint32_t ticket_count, uint8_t category);
+    // can throw
+    ReservationInfo &find_reservation(uint32_t reservation_id, char const *cookie);
+    // Records the first collection of a reservation, once the request
+    // for its tickets has been validated.
+    void collect(uint32_t reservation_id, ReservationInfo &reservation);
+    std::vector<Ticket> make_tickets(const ReservationInfo &reservation,
+                                     uint64_t first, uint32_t count) const;
+    // can throw
     uint32_t get_reservation_id();
     void remove_reservation(const uint32_t reservation_id) noexcept;
     void clean_queue() noexcept;
-    void generate_tickets(ReservationInfo &reservation, uint16_t ticket_count) noexcept;
+    void serve_waitlist(uint32_t event_id, uint8_t category) noexcept;
+    void generate_tickets(ReservationInfo &reservation, uint32_t ticket_count) noexcept;
+    // can throw
+    void add_counts(const std::vector<uint32_t> &counts);
+    void mark_event(uint32_t event_id);
+    void mark_reservation(uint32_t reservation_id);
 };
 
 
@@ -0,0 +1,118 @@
+#include "event_fragments.h"
+
+#include <algorithm>
+#include <cstring> // memcpy
+
+#include <endian.h>
+
+
+///////////////////////////
+///                     ///
+///      CONSTANTS      ///
+///                     ///
+///////////////////////////
+
+
+constexpr std::size_t COUNT_OFFSET = 4; // after the event ID
+
+
+///////////////////////////
+///                     ///
+///     AUXILIARY       ///
+///     FUNCTIONS       ///
+///                     ///
+///////////////////////////
+
+
+namespace {
+    void append_number(std::vector<char> &arena, const void *number, std::size_t length) {
+        const char *bytes = static_cast<const char*>(number);
+        arena.insert(arena.end(), bytes, bytes + length);
+    }
+
+    template<typename EventID>
+    std::size_t gather_entries(std::vector<char> &arena, const std::vector<uint32_t> &offsets,
+                               const Database &db, EventID event_id, std::size_t count,
+                               std::size_t max_length, std::size_t max_iov,
+                               std::vector<iovec> &iov)
+    {
+        const std::size_t entries = offsets.empty() ? 0 : offsets.size() - 1;
+        const std::size_t initial_iov = iov.size();
+        std::size_t length = 0;
+
+        for (std::size_t i = 0; i < count; ++i) {
+            const uint32_t id = event_id(i);
+            if (id >= entries)
+                continue;
+
+            char *entry = &arena[offsets[id]];
+            const std::size_t entry_length = offsets[id + 1] - offsets[id];
+            if (length + entry_length > max_length)
+                break;
+
+            const bool adjacent = iov.size() > initial_iov
+                && static_cast<char*>(iov.back().iov_base) + iov.back().iov_len == entry;
+            if (!adjacent && iov.size() - initial_iov >= max_iov)
+                break;
+
+            const uint16_t ticket_count = htobe16(static_cast<uint16_t>(
+                std::min<uint32_t>(db.available_tickets(id), SATURATED_TICKET_COUNT)
+            ));
+            memcpy(entry + COUNT_OFFSET, &ticket_count, sizeof(ticket_count));
+
+            if (adjacent)
+                iov.back().iov_len += entry_length;
+            else
+                iov.push_back(iovec{entry, entry_length});
+            length += entry_length;
+        }
+        return length;
+    }
+}
+
+
+///////////////////////////
+///                     ///
+///   EVENT FRAGMENTS   ///
+///                     ///
+///////////////////////////
+
+
+void EventFragments::extend(const Database &db) {
+    if (m_offsets.empty())
+        m_offsets.push_back(0);
+
+    for (uint32_t event_id = size(); event_id < db.event_count(); ++event_id) {
+        const Event &event = db.get_event(event_id);
+        const uint32_t id = htobe32(event.event_id);
+        const uint16_t ticket_count = 0; // patched when sent
+        const uint8_t description_length = event.description.length();
+
+        append_number(m_arena, &id, sizeof(id));
+        append_number(m_arena, &ticket_count, sizeof(ticket_count));
+        append_number(m_arena, &description_length, sizeof(description_length));
+        m_arena.insert(m_arena.end(), event.description.begin(),
+                       event.description.begin() + description_length);
+        m_offsets.push_back(m_arena.size());
+    }
+}
+
+std::size_t EventFragments::gather(const Database &db, const uint32_t *event_ids,
+                                   std::size_t count, std::size_t max_length,
+                                   std::size_t max_iov, std::vector<iovec> &iov)
+{
+    return gather_entries(m_arena, m_offsets, db,
+                          [event_ids](std::size_t i) { return event_ids[i]; },
+                          count, max_length, max_iov, iov);
+}
+
+std::size_t EventFragments::gather_range(const Database &db, uint32_t first_event_id,
+                                         std::size_t count, std::size_t max_length,
+                                         std::size_t max_iov, std::vector<iovec> &iov)
+{
+    return gather_entries(m_arena, m_offsets, db,
+                          [first_event_id](std::size_t i) {
+                              return static_cast<uint32_t>(first_event_id + i);
+                          },
+                          count, max_length, max_iov, iov);
+}
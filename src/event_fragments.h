@@ -0,0 +1,45 @@
+#ifndef __EVENT_FRAGMENTS_H__
+#define __EVENT_FRAGMENTS_H__
+
+#include "database.h"
+
+#include <cstdint>
+#include <vector>
+
+#include <sys/uio.h>
+
+// Every event's EVENTS entry (event ID, ticket count, description length,
+// description), serialized once into a single arena. A listing of any
+// subset of events is then a list of iovecs pointing into the arena, with
+// only the ticket counts patched before sending. Entries of consecutive
+// events are adjacent, so they share a single iovec.
+class EventFragments {
+private:
+    std::vector<char>       m_arena;
+    std::vector<uint32_t>   m_offsets; // of every entry, plus the arena's end
+
+public:
+    EventFragments() = default;
+    ~EventFragments() = default;
+
+    // Serializes the events added to `db` since the last call.
+    void extend(const Database &db);
+
+    std::size_t size() const noexcept {
+        return m_offsets.empty() ? 0 : m_offsets.size() - 1;
+    }
+
+    // Appends the entries of the given events to `iov`, updating their
+    // ticket counts from `db`. Stops before exceeding `max_length` bytes
+    // or `max_iov` iovecs. Returns the number of bytes added.
+    std::size_t gather(const Database &db, const uint32_t *event_ids, std::size_t count,
+                       std::size_t max_length, std::size_t max_iov,
+                       std::vector<iovec> &iov);
+
+    // Same for the events [first_event_id, first_event_id + count).
+    std::size_t gather_range(const Database &db, uint32_t first_event_id, std::size_t count,
+                             std::size_t max_length, std::size_t max_iov,
+                             std::vector<iovec> &iov);
+};
+
+#endif // __EVENT_FRAGMENTS_H__
@@ -0,0 +1,168 @@
+#include "fair_scheduler.h"
+
+#include <cstring> // memcpy
+
+
+///////////////////////////
+///                     ///
+///   FAIR SCHEDULER    ///
+///                     ///
+///////////////////////////
+
+
+FairScheduler::FairScheduler(std::size_t slot_count, std::size_t slot_size,
+                             std::size_t flow_count, uint32_t max_flow_length,
+                             uint32_t quantum, uint64_t key)
+: m_slot_size{slot_size}
+, m_max_flow_length{max_flow_length}
+, m_quantum{quantum}
+, m_payloads(slot_count * slot_size)
+, m_slots(slot_count)
+, m_free{slot_count ? 0 : NONE}
+, m_flows(flow_count)
+, m_by_length(max_flow_length + 1, NONE)
+, m_longest{0}
+, m_key{key}
+, m_queued{0}
+, m_dropped{0}
+{
+    for (uint32_t i = 0; i < slot_count; ++i)
+        m_slots[i].next = (i + 1 < slot_count) ? i + 1 : NONE;
+}
+
+bool FairScheduler::push(uint64_t client, uint64_t arrival_time, char const *data,
+                         std::size_t length, uint32_t cost)
+{
+    const uint32_t flow_id = flow_of(client);
+    Flow &flow = m_flows[flow_id];
+    if (flow.length >= m_max_flow_length) {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    if (m_free == NONE) {
+        // Makes room at the expense of the flow with the longest queue.
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        if (!m_longest)
+            return false;
+        // A flow left empty keeps its place in m_active until pop() gets to it.
+        release(take_head(flow.length == m_longest ? flow_id : m_by_length[m_longest]));
+    }
+
+    const uint32_t slot_id = m_free;
+    Slot &slot = m_slots[slot_id];
+    m_free = slot.next;
+    slot = Slot{client, arrival_time, static_cast<uint32_t>(length), cost, NONE};
+    memcpy(&m_payloads[slot_id * m_slot_size], data, length);
+
+    if (flow.tail == NONE) {
+        flow.head = slot_id;
+    } else {
+        m_slots[flow.tail].next = slot_id;
+    }
+    flow.tail = slot_id;
+    set_length(flow_id, flow.length + 1);
+    ++m_queued;
+    if (!flow.active) {
+        // A flow becoming active starts with a full quantum, so that clients
+        // sending occasional requests are served in their first turn.
+        flow.active = true;
+        flow.deficit = m_quantum;
+        m_active.push_back(flow_id);
+    }
+    return true;
+}
+
+bool FairScheduler::pop(Request &request) noexcept {
+    while (!m_active.empty()) {
+        const uint32_t flow_id = m_active.front();
+        Flow &flow = m_flows[flow_id];
+        if (!flow.length) {
+            // Emptied by a drop.
+            flow.active = false;
+            m_active.pop_front();
+            continue;
+        }
+
+        const Slot &head = m_slots[flow.head];
+        if (flow.deficit < static_cast<int64_t>(head.cost)) {
+            flow.deficit += m_quantum;
+            m_active.pop_front();
+            m_active.push_back(flow_id);
+            continue;
+        }
+
+        flow.deficit -= head.cost;
+        const uint32_t slot_id = take_head(flow_id);
+        if (!flow.length) {
+            flow.active = false;
+            m_active.pop_front();
+        }
+        release(slot_id);
+
+        const Slot &slot = m_slots[slot_id];
+        request = Request{slot.client, slot.arrival_time,
+                          &m_payloads[slot_id * m_slot_size], slot.length};
+        return true;
+    }
+    return false;
+}
+
+uint32_t FairScheduler::flow_of(uint64_t client) const noexcept {
+    uint64_t x = client ^ m_key;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return static_cast<uint32_t>(
+        (static_cast<unsigned __int128>(x) * m_flows.size()) >> 64
+    );
+}
+
+uint32_t FairScheduler::take_head(uint32_t flow_id) noexcept {
+    Flow &flow = m_flows[flow_id];
+    const uint32_t slot_id = flow.head;
+    flow.head = m_slots[slot_id].next;
+    if (flow.head == NONE)
+        flow.tail = NONE;
+    set_length(flow_id, flow.length - 1);
+    --m_queued;
+    return slot_id;
+}
+
+// Moves the flow to the list of flows of the new length, which differs
+// from the old one by one, so that finding the longest one takes O(1).
+void FairScheduler::set_length(uint32_t flow_id, uint32_t length) noexcept {
+    Flow &flow = m_flows[flow_id];
+    if (flow.length) {
+        if (flow.prev != NONE) {
+            m_flows[flow.prev].next = flow.next;
+        } else {
+            m_by_length[flow.length] = flow.next;
+        }
+        if (flow.next != NONE)
+            m_flows[flow.next].prev = flow.prev;
+    }
+
+    flow.length = length;
+    flow.prev = NONE;
+    flow.next = NONE;
+    if (length) {
+        flow.next = m_by_length[length];
+        if (flow.next != NONE)
+            m_flows[flow.next].prev = flow_id;
+        m_by_length[length] = flow_id;
+    }
+
+    if (length > m_longest) {
+        m_longest = length;
+    } else if (m_longest && m_by_length[m_longest] == NONE) {
+        --m_longest;
+    }
+}
+
+void FairScheduler::release(uint32_t slot_id) noexcept {
+    m_slots[slot_id].next = m_free;
+    m_free = slot_id;
+}
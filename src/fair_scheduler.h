@@ -0,0 +1,99 @@
+#ifndef __FAIR_SCHEDULER_H__
+#define __FAIR_SCHEDULER_H__
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib> // std::size_t
+#include <deque>
+#include <vector>
+
+// Queues requests per client and hands them out in deficit round robin
+// order, weighted by the cost of every request: in each round, every
+// client with queued requests gets to spend `quantum` on them (plus what
+// it has not spent in the previous rounds).
+//
+// Clients are hashed onto a fixed number of flows, so the memory used does
+// not depend on the number of clients; clients sharing a flow share its
+// turn. The hash is keyed, so that clients cannot pick addresses sharing
+// the flow of another one. Requests are copied into a fixed pool of slots.
+// A request arriving to a full flow is dropped, and so is the oldest
+// request of the longest flow when the pool runs out.
+class FairScheduler {
+public:
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    struct Request {
+        uint64_t    client;
+        uint64_t    arrival_time; // as passed to push()
+        char const *data;
+        std::size_t length;
+    };
+
+private:
+    struct Slot {
+        uint64_t client;
+        uint64_t arrival_time;
+        uint32_t length;
+        uint32_t cost;
+        uint32_t next; // in the flow or in the free list
+    };
+
+    struct Flow {
+        uint32_t head = NONE;
+        uint32_t tail = NONE;
+        uint32_t length = 0;
+        int64_t  deficit = 0;
+        bool     active = false; // in m_active
+        uint32_t prev = NONE; // among the flows of the same length
+        uint32_t next = NONE;
+    };
+
+    const std::size_t       m_slot_size;
+    const uint32_t          m_max_flow_length;
+    const uint32_t          m_quantum;
+    std::vector<char>       m_payloads;
+    std::vector<Slot>       m_slots;
+    uint32_t                m_free;
+    std::vector<Flow>       m_flows;
+    std::deque<uint32_t>    m_active; // flows with queued requests, in turn order
+    std::vector<uint32_t>   m_by_length; // the first flow of every length but 0
+    uint32_t                m_longest; // length of the longest flow
+    const uint64_t          m_key;
+    std::size_t             m_queued;
+    std::atomic<uint64_t>   m_dropped;
+
+public:
+    FairScheduler() = delete;
+    FairScheduler(std::size_t slot_count, std::size_t slot_size, std::size_t flow_count,
+                  uint32_t max_flow_length, uint32_t quantum, uint64_t key);
+    ~FairScheduler() = default;
+
+    // Returns false if the request has been dropped. `length` has to be at
+    // most the slot size and `cost` at most the quantum.
+    bool push(uint64_t client, uint64_t arrival_time, char const *data, std::size_t length,
+              uint32_t cost);
+
+    // The request's data stays valid until the next push().
+    bool pop(Request &request) noexcept;
+
+    bool empty() const noexcept {
+        return !m_queued;
+    }
+
+    std::size_t queued() const noexcept {
+        return m_queued;
+    }
+
+    // Safe to call from any thread.
+    uint64_t dropped() const noexcept {
+        return m_dropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    uint32_t flow_of(uint64_t client) const noexcept;
+    uint32_t take_head(uint32_t flow_id) noexcept;
+    void set_length(uint32_t flow_id, uint32_t length) noexcept;
+    void release(uint32_t slot) noexcept;
+};
+
+#endif // __FAIR_SCHEDULER_H__
@@ -0,0 +1,58 @@
+#include "latency_histogram.h"
+
+#include <bit>
+
+
+///////////////////////////
+///                     ///
+///  LATENCY HISTOGRAM  ///
+///                     ///
+///////////////////////////
+
+
+void LatencyHistogram::record(uint64_t nanoseconds) noexcept {
+    const std::size_t bucket = std::bit_width(nanoseconds);
+    m_counts[bucket < BUCKETS ? bucket : BUCKETS - 1].fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::count() const noexcept {
+    uint64_t result = 0;
+    for (const auto &count : m_counts)
+        result += count.load(std::memory_order_relaxed);
+    return result;
+}
+
+void LatencyHistogram::write(std::ostream &out, const std::string &name) const {
+    uint64_t total = 0;
+    for (std::size_t bucket = 0; bucket < BUCKETS; ++bucket) {
+        const uint64_t count = m_counts[bucket].load(std::memory_order_relaxed);
+        if (!count)
+            continue;
+        out << name << "_le_" << (uint64_t{1} << bucket) << " " << count << "\n";
+        total += count;
+    }
+    out << name << "_count " << total << "\n";
+}
+
+
+///////////////////////////
+///                     ///
+///  REQUEST LATENCIES  ///
+///                     ///
+///////////////////////////
+
+
+RequestLatencies::RequestLatencies()
+: m_histograms{new Histograms[UINT8_MAX + 1]} {}
+
+void RequestLatencies::write(std::ostream &out) const {
+    for (unsigned message_id = 0; message_id <= UINT8_MAX; ++message_id) {
+        const Histograms &histograms = m_histograms[message_id];
+        if (!histograms.total.count())
+            continue;
+        const std::string prefix = "latency_" + std::to_string(message_id);
+        histograms.queue.write(out, prefix + "_queue_ns");
+        histograms.service.write(out, prefix + "_service_ns");
+        histograms.total.write(out, prefix + "_total_ns");
+    }
+}
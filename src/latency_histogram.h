@@ -0,0 +1,61 @@
+#ifndef __LATENCY_HISTOGRAM_H__
+#define __LATENCY_HISTOGRAM_H__
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib> // std::size_t
+#include <memory>
+#include <ostream>
+#include <string>
+
+// Counts of durations (in nanoseconds) in power-of-two buckets: bucket k
+// holds those below 2^k and at least 2^(k-1). Recorded by one thread and
+// safe to read from any other.
+class LatencyHistogram {
+public:
+    static constexpr std::size_t BUCKETS = 40; // up to ~18 minutes
+
+private:
+    std::atomic<uint64_t> m_counts[BUCKETS] = {};
+
+public:
+    LatencyHistogram() = default;
+    ~LatencyHistogram() = default;
+
+    void record(uint64_t nanoseconds) noexcept;
+
+    uint64_t count() const noexcept;
+
+    // One "<name>_le_<bound> <count>" line per nonempty bucket, where the
+    // bound is exclusive, and a "<name>_count <count>" line.
+    void write(std::ostream &out, const std::string &name) const;
+};
+
+// Time requests spend in the socket and the scheduler (queue), being
+// handled (service) and both (total), by message ID.
+class RequestLatencies {
+private:
+    struct Histograms {
+        LatencyHistogram queue;
+        LatencyHistogram service;
+        LatencyHistogram total;
+    };
+
+    std::unique_ptr<Histograms[]> m_histograms; // indexed by message ID
+
+public:
+    RequestLatencies();
+    ~RequestLatencies() = default;
+
+    void record(uint8_t message_id, uint64_t queue_time, uint64_t service_time) noexcept {
+        Histograms &histograms = m_histograms[message_id];
+        histograms.queue.record(queue_time);
+        histograms.service.record(service_time);
+        histograms.total.record(queue_time + service_time);
+    }
+
+    // Message IDs without any requests are skipped.
+    void write(std::ostream &out) const;
+};
+
+#endif // __LATENCY_HISTOGRAM_H__
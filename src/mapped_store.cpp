@@ -0,0 +1,354 @@
+#include "mapped_store.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring> // memcpy, memcmp, memset, strerror
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+///////////////////////////
+///                     ///
+///      CONSTANTS      ///
+///                     ///
+///////////////////////////
+
+
+constexpr char MAGIC[4] = {'T', 'S', 'M', 'S'};
+constexpr uint32_t FORMAT_VERSION = 1;
+// The file header, with the commit records, takes the first memory page.
+constexpr std::size_t HEADER_SIZE = 4096;
+
+
+///////////////////////////
+///                     ///
+///     AUXILIARY       ///
+///      STRUCTS        ///
+///                     ///
+///////////////////////////
+
+
+namespace {
+    // Commits alternate between two of them, so that a torn one leaves
+    // the other intact.
+    struct CommitRecord {
+        uint64_t checksum;
+        uint64_t generation;
+    };
+
+    struct FileHeader {
+        char            magic[4];
+        uint32_t        version;
+        uint32_t        record_size;
+        uint32_t        reserved;
+        CommitRecord    commits[2];
+    };
+    static_assert(sizeof(FileHeader) <= HEADER_SIZE);
+}
+
+struct MappedStore::Record {
+    uint64_t    checksum; // of everything after it, up to the end of the data
+    uint64_t    generation;
+    uint32_t    index;
+    uint32_t    length;
+    uint8_t     kind;
+    uint8_t     reserved[7];
+    char        data[StatePage::MAX_SIZE];
+};
+
+constexpr std::size_t PAIR_SIZE = 2 * sizeof(MappedStore::Record);
+
+
+///////////////////////////
+///                     ///
+///     AUXILIARY       ///
+///     FUNCTIONS       ///
+///                     ///
+///////////////////////////
+
+
+namespace {
+    uint64_t fnv1a(const void *bytes, std::size_t length,
+                   uint64_t hash = 0xcbf29ce484222325ULL) noexcept
+    {
+        const uint8_t *data = static_cast<const uint8_t*>(bytes);
+        for (std::size_t i = 0; i < length; ++i) {
+            hash ^= data[i];
+            hash *= 0x100000001b3ULL;
+        }
+        return hash;
+    }
+
+    template<typename Record>
+    uint64_t record_checksum(const Record &record) noexcept {
+        const char *start = reinterpret_cast<const char*>(&record.generation);
+        const std::size_t header = record.data - start;
+        const std::size_t length = std::min<std::size_t>(record.length, sizeof(record.data));
+        return fnv1a(record.data, length, fnv1a(start, header));
+    }
+
+    uint64_t commit_checksum(const CommitRecord &commit) noexcept {
+        return fnv1a(&commit.generation, sizeof(commit.generation));
+    }
+
+    [[noreturn]] void throw_system_error(const std::string &message) {
+        throw StoreError(message + ": " + strerror(errno));
+    }
+
+    // Adds `newer` to `pages`, replacing their older versions, and
+    // clears it.
+    void add_pages(std::vector<StatePage> &pages, std::vector<StatePage> &newer) {
+        if (pages.empty()) {
+            pages.swap(newer);
+            return;
+        }
+        std::map<std::pair<uint8_t, uint32_t>, std::size_t> positions;
+        for (std::size_t i = 0; i < pages.size(); ++i)
+            positions[{pages[i].kind, pages[i].index}] = i;
+        for (auto &page : newer) {
+            const auto [position, added] =
+                positions.try_emplace({page.kind, page.index}, pages.size());
+            if (added)
+                pages.push_back(std::move(page));
+            else
+                pages[position->second] = std::move(page);
+        }
+        newer.clear();
+    }
+}
+
+
+///////////////////////////
+///                     ///
+///    MAPPED STORE     ///
+///                     ///
+///////////////////////////
+
+
+MappedStore::MappedStore(const std::string &path, uint64_t interval)
+: m_fd{-1}
+, m_interval{interval}
+, m_last_time{0}
+, m_map{nullptr}
+, m_capacity{0}
+, m_generation{0}
+, m_commits{0}
+, m_commit_failures{0}
+{
+    m_fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (m_fd < 0)
+        throw_system_error("Could not open the store file " + path);
+
+    struct stat status;
+    if (fstat(m_fd, &status) < 0) {
+        close(m_fd);
+        throw_system_error("Could not open the store file " + path);
+    }
+    const bool created = status.st_size == 0;
+    const std::size_t size = created ? HEADER_SIZE + INITIAL_PAGES * PAIR_SIZE
+                                     : static_cast<std::size_t>(status.st_size);
+    if (size < HEADER_SIZE || (size - HEADER_SIZE) % PAIR_SIZE
+        || (created && ftruncate(m_fd, size) < 0))
+    {
+        close(m_fd);
+        throw StoreError("Invalid store file: " + path);
+    }
+
+    void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (map == MAP_FAILED) {
+        close(m_fd);
+        throw_system_error("Could not map the store file " + path);
+    }
+    m_map = static_cast<char*>(map);
+    m_capacity = (size - HEADER_SIZE) / PAIR_SIZE;
+
+    FileHeader &header = *reinterpret_cast<FileHeader*>(m_map);
+    if (created) {
+        memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = FORMAT_VERSION;
+        header.record_size = sizeof(Record);
+    } else if (memcmp(header.magic, MAGIC, sizeof(MAGIC))
+               || header.version != FORMAT_VERSION
+               || header.record_size != sizeof(Record))
+    {
+        munmap(m_map, size);
+        close(m_fd);
+        throw StoreError("Invalid store file: " + path);
+    }
+
+    for (const CommitRecord &commit : header.commits)
+        if (commit.checksum == commit_checksum(commit))
+            m_generation = std::max(m_generation, commit.generation);
+
+    // Slots written after the last commit are cleared, so that they cannot
+    // pass for committed ones once generations get that far again.
+    m_current.assign(m_capacity, -1);
+    for (std::size_t pair = m_capacity; pair-- > 0;) {
+        uint64_t best = 0;
+        for (int slot = 0; slot < 2; ++slot) {
+            Record &entry = *record(pair, slot);
+            if (entry.checksum != record_checksum(entry) || entry.length > StatePage::MAX_SIZE)
+                continue;
+            if (entry.generation > m_generation) {
+                entry.checksum = 0;
+                entry.generation = 0;
+            } else if (entry.generation > best) {
+                best = entry.generation;
+                m_current[pair] = slot;
+            }
+        }
+
+        if (m_current[pair] == -1) {
+            m_free.push_back(pair);
+            continue;
+        }
+        const Record &entry = *record(pair, m_current[pair]);
+        if (!m_pages.emplace(PageKey{entry.kind, entry.index}, pair).second) {
+            munmap(m_map, size);
+            close(m_fd);
+            throw StoreError("Invalid store file: " + path);
+        }
+    }
+}
+
+MappedStore::~MappedStore() {
+    munmap(m_map, HEADER_SIZE + m_capacity * PAIR_SIZE);
+    close(m_fd);
+}
+
+// can throw
+// Ordered so that reservations come back in the order of their IDs.
+void MappedStore::read_pages(std::vector<StatePage> &pages) const {
+    for (const auto &[key, pair] : m_pages) {
+        // Allocated by a commit that has failed.
+        if (m_current[pair] == -1)
+            continue;
+        const Record &entry = *record(pair, m_current[pair]);
+        pages.push_back(StatePage{entry.kind, entry.index,
+                                  std::string(entry.data, entry.length)});
+    }
+}
+
+// can throw
+// Called between loop iterations, so a commit covers every change made by
+// the requests served in them.
+void MappedStore::commit(Database &db) {
+    db.take_dirty_pages(m_taken);
+    add_pages(m_dirty, m_taken);
+    if (m_dirty.empty())
+        return;
+
+    // A retried commit gets the same generation and slots as the failed
+    // one, so it cannot overwrite anything committed.
+    m_written.clear();
+    m_written_slots.clear();
+    const uint64_t generation = m_generation + 1;
+    for (const StatePage &page : m_dirty) {
+        const PageKey key{page.kind, page.index};
+        auto it = m_pages.find(key);
+        const std::size_t pair = (it == m_pages.end()) ? allocate(key) : it->second;
+        const int slot = (m_current[pair] == 0) ? 1 : 0;
+
+        Record &entry = *record(pair, slot);
+        entry.generation = generation;
+        entry.index = page.index;
+        entry.length = page.data.size();
+        entry.kind = page.kind;
+        memset(entry.reserved, 0, sizeof(entry.reserved));
+        memcpy(entry.data, page.data.data(), page.data.size());
+        entry.checksum = record_checksum(entry);
+        m_written_slots.emplace_back(pair, slot);
+        m_written.push_back(reinterpret_cast<char*>(&entry) - m_map);
+    }
+    sync_written();
+
+    CommitRecord &commit = reinterpret_cast<FileHeader*>(m_map)->commits[generation % 2];
+    commit.generation = generation;
+    commit.checksum = commit_checksum(commit);
+    sync(0, HEADER_SIZE);
+
+    for (const auto &[pair, slot] : m_written_slots)
+        m_current[pair] = slot;
+    m_dirty.clear();
+    m_generation = generation;
+    m_commits.fetch_add(1, std::memory_order_relaxed);
+}
+
+void MappedStore::commit_if_stale(Database &db, uint64_t now) {
+    if (now - m_last_time < m_interval)
+        return;
+    m_last_time = now;
+    try {
+        commit(db);
+    } catch (const StoreError &e) {
+        m_commit_failures.fetch_add(1, std::memory_order_relaxed);
+        std::cerr << e.what() << "\n";
+    }
+}
+
+MappedStore::Record *MappedStore::record(std::size_t pair, int slot) const noexcept {
+    return reinterpret_cast<Record*>(m_map + HEADER_SIZE + pair * PAIR_SIZE) + slot;
+}
+
+// can throw
+std::size_t MappedStore::allocate(const PageKey &key) {
+    if (m_free.empty())
+        grow();
+    const std::size_t pair = m_free.back();
+    m_free.pop_back();
+    m_pages.emplace(key, pair);
+    return pair;
+}
+
+// can throw
+// New slots are zero, so none of them passes for a valid record.
+void MappedStore::grow() {
+    const std::size_t old_size = HEADER_SIZE + m_capacity * PAIR_SIZE;
+    const std::size_t new_size = HEADER_SIZE + 2 * m_capacity * PAIR_SIZE;
+    if (ftruncate(m_fd, new_size) < 0)
+        throw_system_error("Could not extend the store file");
+    void *map = mremap(m_map, old_size, new_size, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED)
+        throw_system_error("Could not map the store file");
+    m_map = static_cast<char*>(map);
+
+    for (std::size_t pair = 2 * m_capacity; pair-- > m_capacity;)
+        m_free.push_back(pair);
+    m_current.resize(2 * m_capacity, -1);
+    m_capacity *= 2;
+}
+
+// can throw
+void MappedStore::sync(std::size_t offset, std::size_t length) {
+    if (msync(m_map + offset, length, MS_SYNC) < 0)
+        throw_system_error("Could not sync the store file");
+}
+
+// can throw
+// Records sharing memory pages are synced together, up to the end of
+// their data.
+void MappedStore::sync_written() {
+    static const std::size_t page_size = sysconf(_SC_PAGESIZE);
+    std::sort(m_written.begin(), m_written.end());
+    std::size_t start = 0;
+    std::size_t end = 0;
+    for (const std::size_t offset : m_written) {
+        const Record &entry = *reinterpret_cast<const Record*>(m_map + offset);
+        const std::size_t first = offset / page_size * page_size;
+        const std::size_t last = entry.data + entry.length - m_map;
+        if (end && first <= end) {
+            end = std::max(end, last);
+            continue;
+        }
+        if (end)
+            sync(start, end - start);
+        start = first;
+        end = last;
+    }
+    if (end)
+        sync(start, end - start);
+}
@@ -0,0 +1,113 @@
+#ifndef __MAPPED_STORE_H__
+#define __MAPPED_STORE_H__
+
+#include "database.h"
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+class StoreError : public std::runtime_error {
+public:
+    StoreError(const std::string &what_arg)
+    : std::runtime_error{what_arg} {}
+};
+
+// The state pages of a Database (see Database::take_dirty_pages()), kept
+// in place in a memory-mapped file. Every page has a pair of fixed-size
+// record slots, each with a checksum and the generation that wrote it.
+// A commit writes the changed pages to the slots not holding their
+// committed versions, syncs them, and only then syncs a commit record
+// with the new generation. Slots of later generations are ignored, so a
+// crash at any point leaves the state of the last commit.
+//
+// Commits are taken at most every `interval` milliseconds, so a crash
+// loses the changes of up to that long (and of the commit under way),
+// replies to them included. Both syncs run on the calling thread; the
+// first one covers only the memory pages of the records written. A commit
+// that fails keeps its pages, and is retried with the pages changed
+// meanwhile; the slots it has written only become the committed ones once
+// its commit record has been synced.
+//
+// Reopening the file checks every slot in it and loads the newest
+// committed slot of every page, which takes time in proportion to the
+// size of the file rather than to the changes since the last commit.
+class MappedStore {
+public:
+    static constexpr std::size_t INITIAL_PAGES = 64;
+
+    // A page slot, see mapped_store.cpp.
+    struct Record;
+
+private:
+    using PageKey = std::pair<uint8_t, uint32_t>; // kind and index
+
+    int                             m_fd;
+    const uint64_t                  m_interval;
+    uint64_t                        m_last_time; // of the last commit
+    char                           *m_map;
+    std::size_t                     m_capacity; // of page slot pairs
+    uint64_t                        m_generation; // last committed
+    std::atomic<uint64_t>           m_commits;
+    std::atomic<uint64_t>           m_commit_failures;
+    std::map<PageKey, std::size_t>  m_pages; // slot pairs
+    std::vector<int8_t>             m_current; // committed slot per pair, -1 - none
+    std::vector<std::size_t>        m_free; // pairs, the lowest at the back
+    std::vector<StatePage>          m_dirty; // not committed yet
+    std::vector<StatePage>          m_taken;
+    std::vector<std::pair<std::size_t, int8_t>> m_written_slots; // pairs and slots
+    std::vector<std::size_t>        m_written; // offsets of the records
+
+public:
+    MappedStore() = delete;
+    // can throw
+    // Creates the file if it does not exist. Commits are taken at most
+    // every `interval` milliseconds, as long as commit_if_stale() is
+    // called regularly.
+    MappedStore(const std::string &path, uint64_t interval);
+    ~MappedStore();
+
+    MappedStore(const MappedStore&) = delete;
+    MappedStore &operator=(const MappedStore&) = delete;
+
+    // can throw
+    // Appends the committed pages, ordered by kind and index, to `pages`,
+    // for Database::restore_page(). Has to be called before the first
+    // commit.
+    void read_pages(std::vector<StatePage> &pages) const;
+
+    // can throw
+    // Persists the pages changed since the last successful commit.
+    void commit(Database &db);
+
+    // `now` in milliseconds (see Clock::now_ms()). Failed commits are
+    // counted rather than thrown.
+    void commit_if_stale(Database &db, uint64_t now);
+
+    // Safe to call from any thread.
+    uint64_t commits() const noexcept {
+        return m_commits.load(std::memory_order_relaxed);
+    }
+
+    // Safe to call from any thread.
+    uint64_t commit_failures() const noexcept {
+        return m_commit_failures.load(std::memory_order_relaxed);
+    }
+
+private:
+    Record *record(std::size_t pair, int slot) const noexcept;
+    // can throw
+    std::size_t allocate(const PageKey &key);
+    // can throw
+    void grow();
+    // can throw
+    void sync(std::size_t offset, std::size_t length);
+    // can throw
+    void sync_written();
+};
+
+#endif // __MAPPED_STORE_H__
@@ -0,0 +1,36 @@
+#include "metrics.h"
+
+#include <fstream>
+#include <thread>
+
+#include <pthread.h>
+#include <signal.h>
+
+
+///////////////////////////
+///                     ///
+///       METRICS       ///
+///                     ///
+///////////////////////////
+
+
+void Metrics::write(std::ostream &out) const {
+    for (const auto &writer : m_writers)
+        writer(out);
+}
+
+void Metrics::export_on_signal(int signal_number, const std::string &path) const {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, signal_number);
+    if (pthread_sigmask(SIG_BLOCK, &signals, nullptr))
+        throw MetricsError("Could not block the metrics export signal.");
+
+    std::thread([this, signals, path] {
+        int received;
+        while (!sigwait(&signals, &received)) {
+            std::ofstream out(path, std::ios::trunc);
+            write(out);
+        }
+    }).detach();
+}
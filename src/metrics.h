@@ -0,0 +1,56 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+class MetricsError : public std::runtime_error {
+public:
+    MetricsError(const std::string &what_arg)
+    : std::runtime_error{what_arg} {}
+};
+
+// Named values read on demand, written as "name value" lines. The
+// readers run on the exporting thread, so they may only touch state
+// that is safe to read concurrently (atomics, syscalls).
+class Metrics {
+public:
+    using Reader = std::function<uint64_t()>;
+    // Writes any number of lines, for sources with many values.
+    using Writer = std::function<void(std::ostream&)>;
+
+private:
+    std::vector<Writer> m_writers;
+
+public:
+    Metrics() = default;
+    ~Metrics() = default;
+
+    // Must not be called after export_on_signal().
+    void add(std::string name, Reader reader) {
+        m_writers.emplace_back([name = std::move(name), reader = std::move(reader)]
+                               (std::ostream &out) {
+            out << name << " " << reader() << "\n";
+        });
+    }
+
+    // Must not be called after export_on_signal().
+    void add(Writer writer) {
+        m_writers.push_back(std::move(writer));
+    }
+
+    void write(std::ostream &out) const;
+
+    // can throw
+    // Blocks `signal_number` and starts a thread that writes the metrics
+    // to `path` each time the signal is received. The object has to
+    // outlive the process' use of the signal.
+    void export_on_signal(int signal_number, const std::string &path) const;
+};
+
+#endif // __METRICS_H__
@@ -1,17 +1,25 @@
 #ifndef __NETWORKING_H__
 #define __NETWORKING_H__
 
+#include <algorithm>
 #include <bit>
 #include <cassert>
 #include <cstdlib>
 #include <cstring> // std::memcpy, std::strerror
 #include <concepts>
+#include <cstdint>
 #include <exception>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <vector>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <time.h>
 #include <unistd.h>
 #include <endian.h>
 
@@ -34,7 +42,7 @@ public:
     BindSocketError(int errno_value)
     : std::runtime_error{
         std::string{"Binding a socket has failed with errno set to code "}
-        + std::strerror(errno) + "."
+        + std::strerror(errno_value) + "."
     } {}
 };
 
@@ -43,7 +51,7 @@ public:
     ReceiveError(int errno_value)
     : std::runtime_error{
         std::string{"An attempt to receive a message has failed with errno set to code"}
-        + std::strerror(errno) + "."
+        + std::strerror(errno_value) + "."
     } {}
 };
 
@@ -55,7 +63,7 @@ class SendError : public std::exception {
 
 class NetworkReader {
 private:
-    const char const   *m_buffer;
+    char const         *m_buffer;
     std::size_t         m_offset;
     const std::size_t   m_buffer_size;
 
@@ -73,29 +81,24 @@ public:
     template<typename T>
         requires std::integral<T> || std::floating_point<T>
     T read_number() {
-        switch (sizeof(T)) {
-            case 1:
-            case 2:
-            case 4:
-            case 8:     break;
-            default:    throw InvalidType(); // should never occur
-        }
-
-        char bytes[8];
-        get_bytes(bytes, sizeof(T));
-        
-        switch (sizeof(T)) {
-            case 1:
-                return std::bit_cast<T>(*bytes);
-            case 2:
-                return std::bit_cast<T>(htobe16(std::bit_cast<uint16_t>(*bytes)));
-            case 4:
-                return std::bit_cast<T>(htobe32(std::bit_cast<uint32_t>(*bytes)));
-            case 8:
-                return std::bit_cast<T>(htobe64(std::bit_cast<uint64_t>(*bytes)));
-            default:
-                // never occurs
-                assert(false);
+        if constexpr (sizeof(T) == 1) {
+            uint8_t number;
+            read_bytes(reinterpret_cast<char*>(&number), sizeof(number));
+            return std::bit_cast<T>(number);
+        } else if constexpr (sizeof(T) == 2) {
+            uint16_t number;
+            read_bytes(reinterpret_cast<char*>(&number), sizeof(number));
+            return std::bit_cast<T>(be16toh(number));
+        } else if constexpr (sizeof(T) == 4) {
+            uint32_t number;
+            read_bytes(reinterpret_cast<char*>(&number), sizeof(number));
+            return std::bit_cast<T>(be32toh(number));
+        } else if constexpr (sizeof(T) == 8) {
+            uint64_t number;
+            read_bytes(reinterpret_cast<char*>(&number), sizeof(number));
+            return std::bit_cast<T>(be64toh(number));
+        } else {
+            throw InvalidType(); // should never occur
         }
     }
 
@@ -117,6 +120,19 @@ public:
         read_bytes(bytes, m_buffer_size - m_offset);
     }
 
+    // Views into the buffer, valid only as long as the buffer is; no copying.
+    std::string_view read_view(std::size_t length) {
+        if (m_buffer_size - m_offset < length)
+            throw BufferOverflow();
+        std::string_view view{&m_buffer[m_offset], length};
+        m_offset += length;
+        return view;
+    }
+
+    std::string_view read_view() {
+        return read_view(m_buffer_size - m_offset);
+    }
+
     std::size_t size() const noexcept {
         return m_buffer_size;
     }
@@ -135,8 +151,8 @@ private:
 public:
     NetworkWriter() = delete;
     NetworkWriter(std::size_t buffer_size)
-    : m_buffer_size{buffer_size}
-    , m_offset(0)
+    : m_offset(0)
+    , m_buffer_size{buffer_size}
     {
         m_buffer = new char[m_buffer_size];
     }
@@ -148,24 +164,42 @@ public:
     template<typename T>
         requires std::integral<T> || std::floating_point<T>
     void add_number(T number) {
-        switch (sizeof(T)) {
-            case 1:
-                break;
-            case 2:
-                number = std::bit_cast<T>(htobe16(std::bit_cast<uint16_t>(number)));
-                break;
-            case 4:
-                number = std::bit_cast<T>(htobe32(std::bit_cast<uint32_t>(number)));
-                break;
-            case 8:
-                number = std::bit_cast<T>(htobe64(std::bit_cast<uint64_t>(number)));
-                break;
-            default:
-                // In practice, this case never occurs
-                throw InvalidType();
+        if constexpr (sizeof(T) == 1) {
+            write_to_buffer(reinterpret_cast<char const*>(&number), sizeof(T));
+        } else if constexpr (sizeof(T) == 2) {
+            const uint16_t bytes = htobe16(std::bit_cast<uint16_t>(number));
+            write_to_buffer(reinterpret_cast<char const*>(&bytes), sizeof(bytes));
+        } else if constexpr (sizeof(T) == 4) {
+            const uint32_t bytes = htobe32(std::bit_cast<uint32_t>(number));
+            write_to_buffer(reinterpret_cast<char const*>(&bytes), sizeof(bytes));
+        } else if constexpr (sizeof(T) == 8) {
+            const uint64_t bytes = htobe64(std::bit_cast<uint64_t>(number));
+            write_to_buffer(reinterpret_cast<char const*>(&bytes), sizeof(bytes));
+        } else {
+            // In practice, this case never occurs
+            throw InvalidType();
         }
-        char *bytes = std::bit_cast<char*>(&number);
-        write_to_buffer(bytes, sizeof(T));
+    }
+
+    // LEB128: 7 bits per byte, least significant group first.
+    void add_varint(uint64_t number) {
+        char bytes[10];
+        std::size_t length = 0;
+        while (number >= 0x80) {
+            bytes[length++] = static_cast<char>(number | 0x80);
+            number >>= 7;
+        }
+        bytes[length++] = static_cast<char>(number);
+        write_to_buffer(bytes, length);
+    }
+
+    static std::size_t varint_length(uint64_t number) noexcept {
+        std::size_t length = 1;
+        while (number >= 0x80) {
+            number >>= 7;
+            ++length;
+        }
+        return length;
     }
 
     void write_to_buffer(char const *bytes, std::size_t length) {
@@ -181,13 +215,17 @@ public:
         if (m_buffer_size - m_offset < length)
             throw BufferOverflow();
         bytes.copy(&m_buffer[m_offset], length);
-        m_offset += bytes.length();
+        m_offset += length;
     }
 
     void write_to_buffer(const std::string &bytes) {
         write_to_buffer(bytes, bytes.length());
     }
 
+    char const *data() const noexcept {
+        return m_buffer;
+    }
+
     std::size_t length() const noexcept {
         return m_offset;
     }
@@ -195,8 +233,150 @@ public:
     std::size_t size() const noexcept {
         return m_buffer_size;
     }
+
+    // Starts a new message in the same buffer.
+    void clear() noexcept {
+        m_offset = 0;
+    }
 };
 
+// Current CLOCK_REALTIME time in nanoseconds, the clock of the kernel's
+// receive timestamps.
+uint64_t realtime_ns() noexcept {
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+// Buffers for receiving up to `capacity` datagrams with a single syscall.
+// On sockets with SO_TIMESTAMPNS enabled, the kernel's receive timestamps
+// come with them.
+class MessageBatch {
+private:
+    static constexpr std::size_t CONTROL_SIZE = CMSG_SPACE(sizeof(timespec));
+
+    const std::size_t           m_message_size;
+    std::vector<char>           m_buffers;
+    std::vector<sockaddr_in>    m_addresses;
+    std::vector<iovec>          m_iov;
+    std::vector<mmsghdr>        m_headers;
+    // Aligned for cmsghdr.
+    std::vector<uint64_t>       m_controls;
+    std::size_t                 m_count;
+    uint64_t                    m_receive_time;
+
+public:
+    MessageBatch() = delete;
+    MessageBatch(std::size_t capacity, std::size_t message_size)
+    : m_message_size{message_size}
+    , m_buffers(capacity * message_size)
+    , m_addresses(capacity)
+    , m_iov(capacity)
+    , m_headers(capacity)
+    , m_controls(capacity * CONTROL_SIZE / sizeof(uint64_t))
+    , m_count{0}
+    , m_receive_time{0}
+    {
+        static_assert(CONTROL_SIZE % sizeof(uint64_t) == 0);
+        for (std::size_t i = 0; i < capacity; ++i) {
+            m_iov[i] = iovec{&m_buffers[i * message_size], message_size};
+            msghdr &header = m_headers[i].msg_hdr;
+            memset(&header, 0, sizeof(header));
+            header.msg_name = &m_addresses[i];
+            header.msg_iov = &m_iov[i];
+            header.msg_iovlen = 1;
+        }
+    }
+    ~MessageBatch() = default;
+
+    // can throw
+    // Waits for the first datagram unless `wait` is false, then takes the
+    // ones already queued, up to `max_count` (at most the capacity).
+    // Returns their number.
+    std::size_t receive(int socket_fd, bool wait, std::size_t max_count) {
+        max_count = std::min(max_count, m_headers.size());
+        for (std::size_t i = 0; i < max_count; ++i) {
+            msghdr &header = m_headers[i].msg_hdr;
+            header.msg_namelen = static_cast<socklen_t>(sizeof(sockaddr_in));
+            header.msg_control = control(i);
+            header.msg_controllen = CONTROL_SIZE;
+        }
+        const int flags = wait ? MSG_WAITFORONE : MSG_DONTWAIT;
+        int count = recvmmsg(socket_fd, m_headers.data(), max_count, flags, nullptr);
+        if (count == -1) {
+            if (wait || (errno != EAGAIN && errno != EWOULDBLOCK))
+                throw ReceiveError(errno);
+            count = 0;
+        }
+        m_count = count;
+        m_receive_time = realtime_ns();
+        return m_count;
+    }
+
+    std::size_t receive(int socket_fd, bool wait) {
+        return receive(socket_fd, wait, m_headers.size());
+    }
+
+    std::size_t size() const noexcept {
+        return m_count;
+    }
+
+    char const *data(std::size_t i) const noexcept {
+        return &m_buffers[i * m_message_size];
+    }
+
+    std::size_t length(std::size_t i) const noexcept {
+        return m_headers[i].msg_len;
+    }
+
+    const sockaddr_in &address(std::size_t i) const noexcept {
+        return m_addresses[i];
+    }
+
+    // When the kernel received the datagram (CLOCK_REALTIME nanoseconds),
+    // or when receive() returned if the socket does not timestamp.
+    uint64_t timestamp(std::size_t i) const noexcept {
+        msghdr header = m_headers[i].msg_hdr;
+        for (cmsghdr *message = CMSG_FIRSTHDR(&header); message;
+             message = CMSG_NXTHDR(&header, message))
+        {
+            if (message->cmsg_level == SOL_SOCKET && message->cmsg_type == SCM_TIMESTAMPNS) {
+                timespec time;
+                memcpy(&time, CMSG_DATA(message), sizeof(time));
+                return static_cast<uint64_t>(time.tv_sec) * 1000000000 + time.tv_nsec;
+            }
+        }
+        return m_receive_time;
+    }
+
+private:
+    void *control(std::size_t i) noexcept {
+        return &m_controls[i * CONTROL_SIZE / sizeof(uint64_t)];
+    }
+};
+
+// can throw
+// Makes the kernel timestamp received datagrams, see MessageBatch::timestamp().
+void enable_timestamps(int socket_fd) {
+    int enable = 1;
+    if (setsockopt(socket_fd, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable)))
+        throw ReceiveError(errno);
+}
+
+// Packs the address and port (both in network byte order) into an integer.
+uint64_t address_to_id(const sockaddr_in &address) noexcept {
+    return static_cast<uint64_t>(address.sin_addr.s_addr) << 16 | address.sin_port;
+}
+
+sockaddr_in id_to_address(uint64_t id) noexcept {
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = static_cast<uint32_t>(id >> 16);
+    address.sin_port = static_cast<uint16_t>(id);
+    return address;
+}
+
 // IP_V4, UDP
 int bind_socket(uint16_t port) {
     int socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
@@ -214,6 +394,18 @@ int bind_socket(uint16_t port) {
     return socket_fd;
 }
 
+// can throw
+// Waits until at least one of the sockets has a datagram to read, or for
+// `timeout` milliseconds at most (-1 - no limit).
+void wait_for_messages(const int *socket_fds, std::size_t count, int timeout = -1) {
+    std::vector<pollfd> fds(count);
+    for (std::size_t i = 0; i < count; ++i)
+        fds[i] = pollfd{socket_fds[i], POLLIN, 0};
+    while (poll(fds.data(), count, timeout) == -1)
+        if (errno != EINTR)
+            throw ReceiveError(errno);
+}
+
 std::size_t read_message(int socket_fd, sockaddr_in &client_address,
                          char *buffer, std::size_t max_length)
 {
@@ -238,5 +430,25 @@ void send_message(int socket_fd, const sockaddr_in &client_address,
         throw SendError();
 }
 
+// Sends the concatenation of `iov_count` buffers as a single datagram.
+void send_message(int socket_fd, const sockaddr_in &client_address,
+                  const iovec *iov, std::size_t iov_count)
+{
+    msghdr message{};
+    message.msg_name = const_cast<sockaddr_in*>(&client_address);
+    message.msg_namelen = static_cast<socklen_t>(sizeof(client_address));
+    message.msg_iov = const_cast<iovec*>(iov);
+    message.msg_iovlen = iov_count;
+
+    std::size_t length = 0;
+    for (std::size_t i = 0; i < iov_count; ++i)
+        length += iov[i].iov_len;
+
+    int flags = 0;
+    ssize_t sent_length = sendmsg(socket_fd, &message, flags);
+    if (sent_length != static_cast<ssize_t>(length))
+        throw SendError();
+}
+
 #endif // __NETWORKING_H__
 
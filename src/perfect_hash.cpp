@@ -0,0 +1,118 @@
+#include "perfect_hash.h"
+
+#include <algorithm>
+#include <numeric>
+
+
+///////////////////////////
+///                     ///
+///      CONSTANTS      ///
+///                     ///
+///////////////////////////
+
+
+// Average number of keys per bucket.
+constexpr std::size_t BUCKET_SIZE = 4;
+// Displacements tried for a single bucket before starting over with a new seed.
+constexpr uint32_t MAX_DISPLACEMENT = 1 << 16;
+constexpr uint64_t SEED_STEP = 0x9e3779b97f4a7c15ULL;
+
+
+///////////////////////////
+///                     ///
+///    PERFECT HASH     ///
+///                     ///
+///////////////////////////
+
+
+bool PerfectHash::build(const std::vector<uint64_t> &keys) {
+    m_displacements.clear();
+    m_entries.clear();
+
+    const std::size_t key_count = keys.size();
+    if (!key_count)
+        return true;
+
+    {
+        std::vector<uint64_t> sorted(keys);
+        std::sort(sorted.begin(), sorted.end());
+        if (std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end())
+            return false;
+    }
+
+    const std::size_t bucket_count = (key_count + BUCKET_SIZE - 1) / BUCKET_SIZE;
+    std::vector<uint64_t> hashes(key_count);
+    std::vector<uint32_t> order(key_count);
+    std::vector<uint32_t> bucket_sizes(bucket_count);
+    std::vector<bool> taken(key_count);
+    std::vector<std::size_t> slots;
+
+    for (uint64_t seed = SEED_STEP;; seed += SEED_STEP) {
+        std::fill(bucket_sizes.begin(), bucket_sizes.end(), 0);
+        for (std::size_t i = 0; i < key_count; ++i) {
+            hashes[i] = mix(keys[i] ^ seed);
+            ++bucket_sizes[reduce(hashes[i], bucket_count)];
+        }
+
+        // Place the largest buckets first, while the table is still empty.
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            const std::size_t bucket_a = reduce(hashes[a], bucket_count);
+            const std::size_t bucket_b = reduce(hashes[b], bucket_count);
+            if (bucket_sizes[bucket_a] != bucket_sizes[bucket_b])
+                return bucket_sizes[bucket_a] > bucket_sizes[bucket_b];
+            return bucket_a < bucket_b;
+        });
+
+        m_displacements.assign(bucket_count, 0);
+        m_entries.assign(key_count, Entry{0, NOT_FOUND});
+        std::fill(taken.begin(), taken.end(), false);
+
+        bool success = true;
+        std::size_t free_slot = 0;
+        for (std::size_t begin = 0; begin < key_count && success;) {
+            const std::size_t bucket = reduce(hashes[order[begin]], bucket_count);
+            const std::size_t end = begin + bucket_sizes[bucket];
+
+            // Searching a displacement for the last few single-key buckets
+            // would take ~key_count attempts each; point them directly at
+            // the remaining free slots instead.
+            if (end - begin == 1) {
+                while (taken[free_slot])
+                    ++free_slot;
+                taken[free_slot] = true;
+                m_displacements[bucket] = DIRECT_SLOT | static_cast<uint32_t>(free_slot);
+                m_entries[free_slot] = Entry{keys[order[begin]], order[begin]};
+                begin = end;
+                continue;
+            }
+
+            success = false;
+            for (uint32_t displacement = 0; displacement < MAX_DISPLACEMENT; ++displacement) {
+                slots.clear();
+                bool fits = true;
+                for (std::size_t i = begin; i < end && fits; ++i) {
+                    const std::size_t slot = reduce(slot_hash(hashes[order[i]], displacement), key_count);
+                    fits = !taken[slot] && std::find(slots.begin(), slots.end(), slot) == slots.end();
+                    slots.push_back(slot);
+                }
+                if (!fits)
+                    continue;
+
+                m_displacements[bucket] = displacement;
+                for (std::size_t i = begin; i < end; ++i) {
+                    taken[slots[i - begin]] = true;
+                    m_entries[slots[i - begin]] = Entry{keys[order[i]], order[i]};
+                }
+                success = true;
+                break;
+            }
+            begin = end;
+        }
+
+        if (success) {
+            m_seed = seed;
+            return true;
+        }
+    }
+}
@@ -0,0 +1,79 @@
+#ifndef __PERFECT_HASH_H__
+#define __PERFECT_HASH_H__
+
+#include <cstdint>
+#include <vector>
+
+// Minimal perfect hash from a static set of 64-bit keys to their positions
+// in the vector passed to build() ("hash and displace", CHD-style).
+//
+// Keys are split into buckets by one hash; every bucket gets a displacement
+// chosen at build time so that its keys land in free slots of a table with
+// exactly one slot per key. A lookup is two hashes, two array reads and a
+// single key comparison, with no probing. Buckets holding a single key
+// store their slot directly instead of a displacement.
+class PerfectHash {
+public:
+    static constexpr uint32_t NOT_FOUND = UINT32_MAX;
+
+private:
+    // Set in the displacement of a single-key bucket that stores its slot
+    // directly.
+    static constexpr uint32_t DIRECT_SLOT = 1u << 31;
+
+    struct Entry {
+        uint64_t key;
+        uint32_t value;
+    };
+
+    uint64_t                m_seed = 0;
+    std::vector<uint32_t>   m_displacements;
+    std::vector<Entry>      m_entries;
+
+public:
+    PerfectHash() = default;
+    ~PerfectHash() = default;
+
+    // Returns false (and leaves the table empty) if the keys are not unique.
+    // At most 2^31 keys are supported.
+    bool build(const std::vector<uint64_t> &keys);
+
+    uint32_t find(uint64_t key) const noexcept {
+        if (m_entries.empty())
+            return NOT_FOUND;
+        const uint64_t hash = mix(key ^ m_seed);
+        const uint32_t displacement = m_displacements[reduce(hash, m_displacements.size())];
+        const std::size_t hashed_slot = reduce(slot_hash(hash, displacement), m_entries.size());
+        const std::size_t slot = (displacement & DIRECT_SLOT)
+                                 ? displacement & ~DIRECT_SLOT : hashed_slot;
+        const Entry &entry = m_entries[slot];
+        return entry.key == key ? entry.value : NOT_FOUND;
+    }
+
+    std::size_t size() const noexcept {
+        return m_entries.size();
+    }
+
+private:
+    static uint64_t mix(uint64_t x) noexcept {
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdULL;
+        x ^= x >> 33;
+        x *= 0xc4ceb9fe1a85ec53ULL;
+        x ^= x >> 33;
+        return x;
+    }
+
+    static uint64_t slot_hash(uint64_t hash, uint32_t displacement) noexcept {
+        return mix(hash + (displacement + 1) * 0x9e3779b97f4a7c15ULL);
+    }
+
+    // Maps a hash onto [0, range) without a division.
+    static std::size_t reduce(uint64_t hash, std::size_t range) noexcept {
+        return static_cast<std::size_t>(
+            (static_cast<unsigned __int128>(hash) * range) >> 64
+        );
+    }
+};
+
+#endif // __PERFECT_HASH_H__
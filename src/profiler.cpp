@@ -0,0 +1,267 @@
+#include "profiler.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>  // snprintf, sscanf
+#include <cstring> // std::strerror
+#include <fstream>
+#include <map>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>  // gettid
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+
+///////////////////////////
+///                     ///
+///    SAMPLE BUFFER    ///
+///                     ///
+///////////////////////////
+
+
+namespace {
+    struct Slot {
+        // Holds `position + 1` once the sample at `position` is complete.
+        std::atomic<uint64_t>   sequence{0};
+        uint32_t                depth;
+        uintptr_t               frames[Profiler::MAX_DEPTH];
+    };
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free,
+                  "The sample buffer is written from a signal handler.");
+
+    Slot                    slots[Profiler::BUFFER_SIZE];
+    std::atomic<uint64_t>   write_position{0};
+    std::atomic<uint64_t>   read_position{0};
+    std::atomic<uint64_t>   dropped_samples{0};
+    std::atomic<bool>       is_running{false};
+
+    // Bounds of the profiled thread's stack, used to reject bogus frame
+    // pointers before dereferencing them.
+    uintptr_t               stack_low;
+    uintptr_t               stack_high;
+    timer_t                 timer;
+
+    // Aggregated stacks (innermost frame first), owned by the exporter.
+    std::map<std::vector<uintptr_t>, uint64_t> folded;
+
+    bool claim_slot(uint64_t &position) noexcept {
+        position = write_position.load(std::memory_order_relaxed);
+        do {
+            if (position - read_position.load(std::memory_order_acquire) >= Profiler::BUFFER_SIZE)
+                return false;
+        } while (!write_position.compare_exchange_weak(position, position + 1,
+                                                       std::memory_order_relaxed));
+        return true;
+    }
+
+    bool valid_frame(uintptr_t frame_pointer) noexcept {
+        return frame_pointer % sizeof(uintptr_t) == 0
+               && frame_pointer >= stack_low
+               && frame_pointer <= stack_high - 2 * sizeof(uintptr_t);
+    }
+
+    void take_sample(int, siginfo_t *, void *context) {
+        if (!is_running.load(std::memory_order_relaxed))
+            return;
+
+        const ucontext_t *ucontext = static_cast<const ucontext_t*>(context);
+#if defined(__x86_64__)
+        const uintptr_t pc = ucontext->uc_mcontext.gregs[REG_RIP];
+        uintptr_t frame_pointer = ucontext->uc_mcontext.gregs[REG_RBP];
+#elif defined(__aarch64__)
+        const uintptr_t pc = ucontext->uc_mcontext.pc;
+        uintptr_t frame_pointer = ucontext->uc_mcontext.regs[29];
+#else
+        (void) ucontext;
+        return;
+#endif
+
+        uint64_t position;
+        if (!claim_slot(position)) {
+            dropped_samples.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        Slot *slot = &slots[position % Profiler::BUFFER_SIZE];
+        uint32_t depth = 0;
+        slot->frames[depth++] = pc;
+        while (depth < Profiler::MAX_DEPTH && valid_frame(frame_pointer)) {
+            const uintptr_t *frame = reinterpret_cast<const uintptr_t*>(frame_pointer);
+            const uintptr_t next_frame_pointer = frame[0];
+            const uintptr_t return_address = frame[1];
+            if (!return_address)
+                break;
+            slot->frames[depth++] = return_address;
+            if (next_frame_pointer <= frame_pointer)
+                break;
+            frame_pointer = next_frame_pointer;
+        }
+        slot->depth = depth;
+        slot->sequence.store(position + 1, std::memory_order_release);
+    }
+
+    void drain() {
+        uint64_t position = read_position.load(std::memory_order_relaxed);
+        const uint64_t end = write_position.load(std::memory_order_acquire);
+        for (; position < end; ++position) {
+            Slot &slot = slots[position % Profiler::BUFFER_SIZE];
+            if (slot.sequence.load(std::memory_order_acquire) != position + 1)
+                break; // still being written
+            ++folded[std::vector<uintptr_t>(slot.frames, slot.frames + slot.depth)];
+            read_position.store(position + 1, std::memory_order_release);
+        }
+    }
+
+    struct Mapping {
+        uintptr_t   start;
+        uintptr_t   end;
+        uintptr_t   offset;
+        std::string module;
+    };
+
+    std::vector<Mapping> read_executable_mappings() {
+        std::vector<Mapping> result;
+        std::ifstream maps("/proc/self/maps");
+        std::string line;
+        while (std::getline(maps, line)) {
+            unsigned long start, end, offset;
+            char permissions[5];
+            int path_offset = -1;
+            if (sscanf(line.c_str(), "%lx-%lx %4s %lx %*s %*s %n",
+                       &start, &end, permissions, &offset, &path_offset) < 4)
+                continue;
+            if (permissions[2] != 'x' || path_offset < 0
+                || static_cast<std::size_t>(path_offset) >= line.size())
+                continue;
+            std::string path = line.substr(path_offset);
+            result.push_back(Mapping{start, end, offset,
+                                     path.substr(path.find_last_of('/') + 1)});
+        }
+        return result;
+    }
+
+    void write_frame(std::ostream &out, const std::vector<Mapping> &mappings,
+                     uintptr_t address)
+    {
+        char buffer[32];
+        for (const auto &mapping : mappings) {
+            if (mapping.start <= address && address < mapping.end) {
+                snprintf(buffer, sizeof(buffer), "+0x%lx",
+                         static_cast<unsigned long>(address - mapping.start + mapping.offset));
+                out << mapping.module << buffer;
+                return;
+            }
+        }
+        snprintf(buffer, sizeof(buffer), "0x%lx", static_cast<unsigned long>(address));
+        out << buffer;
+    }
+}
+
+
+///////////////////////////
+///                     ///
+///      PROFILER       ///
+///                     ///
+///////////////////////////
+
+
+// can throw
+void Profiler::start(unsigned frequency) {
+    if (!frequency || is_running.load())
+        return;
+
+    pthread_attr_t attributes;
+    void *stack_address;
+    std::size_t stack_size;
+    if (pthread_getattr_np(pthread_self(), &attributes))
+        throw ProfilerError("Could not read the stack bounds of the profiled thread.");
+    pthread_attr_getstack(&attributes, &stack_address, &stack_size);
+    pthread_attr_destroy(&attributes);
+    stack_low = reinterpret_cast<uintptr_t>(stack_address);
+    stack_high = stack_low + stack_size;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = take_sample;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, nullptr))
+        throw ProfilerError(std::string{"sigaction: "} + std::strerror(errno));
+
+    // Sample the CPU time of the calling (serving) thread only.
+    struct sigevent event;
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_notify_thread_id = gettid();
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &timer))
+        throw ProfilerError(std::string{"timer_create: "} + std::strerror(errno));
+
+    const long interval_ns = 1'000'000'000L / frequency;
+    struct itimerspec interval;
+    interval.it_interval.tv_sec = interval_ns / 1'000'000'000L;
+    interval.it_interval.tv_nsec = interval_ns % 1'000'000'000L;
+    interval.it_value = interval.it_interval;
+
+    is_running.store(true);
+    if (timer_settime(timer, 0, &interval, nullptr)) {
+        is_running.store(false);
+        timer_delete(timer);
+        throw ProfilerError(std::string{"timer_settime: "} + std::strerror(errno));
+    }
+}
+
+void Profiler::stop() noexcept {
+    if (!is_running.exchange(false))
+        return;
+    timer_delete(timer);
+}
+
+bool Profiler::running() noexcept {
+    return is_running.load(std::memory_order_relaxed);
+}
+
+uint64_t Profiler::dropped() noexcept {
+    return dropped_samples.load(std::memory_order_relaxed);
+}
+
+void Profiler::write_folded(std::ostream &out) {
+    drain();
+
+    const auto mappings = read_executable_mappings();
+    for (const auto &[frames, count] : folded) {
+        // Outermost frame first. Return addresses point past the call,
+        // so step back into the calling instruction for symbolization.
+        for (std::size_t i = frames.size(); i-- > 0;) {
+            write_frame(out, mappings, i ? frames[i] - 1 : frames[i]);
+            out << (i ? ';' : ' ');
+        }
+        out << count << '\n';
+    }
+}
+
+// can throw
+void Profiler::export_on_signal(int signal_number, const std::string &path) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, signal_number);
+    if (pthread_sigmask(SIG_BLOCK, &signals, nullptr))
+        throw ProfilerError("Could not block the profile export signal.");
+
+    std::thread([signals, path] {
+        int received;
+        while (!sigwait(&signals, &received)) {
+            std::ofstream out(path, std::ios::trunc);
+            write_folded(out);
+        }
+    }).detach();
+}
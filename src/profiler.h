@@ -0,0 +1,55 @@
+#ifndef __PROFILER_H__
+#define __PROFILER_H__
+
+#include <cstdint>
+#include <cstdlib> // std::size_t
+#include <ostream>
+#include <stdexcept>
+#include <string>
+
+class ProfilerError : public std::runtime_error {
+public:
+    ProfilerError(const std::string &what_arg)
+    : std::runtime_error{what_arg} {}
+};
+
+// In-process sampling profiler.
+//
+// A POSIX timer on the CPU clock of the thread that called start() delivers
+// SIGPROF to that thread at the requested frequency, so only the serving
+// thread is sampled (its stack is the only one the unwinder knows). The
+// handler walks the frame-pointer chain of the interrupted context and
+// stores the return addresses in a lock-free ring buffer.
+// Samples are aggregated into folded stacks ("frame;frame;frame count")
+// only when exported. Frames are written as "module+0xoffset" so they can
+// be symbolized offline (e.g. with addr2line) and fed to flamegraph.pl.
+//
+// The unwinder relies on frame pointers, so the binary should be built
+// with -fno-omit-frame-pointer.
+class Profiler {
+public:
+    static constexpr std::size_t MAX_DEPTH = 48;
+    static constexpr std::size_t BUFFER_SIZE = 1 << 14; // samples
+
+    Profiler() = delete;
+
+    // can throw
+    static void start(unsigned frequency);
+    static void stop() noexcept;
+
+    static bool running() noexcept;
+    // Samples lost because the buffer was full.
+    static uint64_t dropped() noexcept;
+
+    // Drains the sample buffer and writes the stacks aggregated so far.
+    // Must not be called concurrently with itself.
+    static void write_folded(std::ostream &out);
+
+    // can throw
+    // Blocks `signal_number` and starts a thread that writes the folded
+    // stacks to `path` each time the signal is received. Must be called
+    // before any other thread is started.
+    static void export_on_signal(int signal_number, const std::string &path);
+};
+
+#endif // __PROFILER_H__
@@ -0,0 +1,292 @@
+#include "sales_ledger.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring> // memcmp, memcpy, strerror
+#include <iostream>
+#include <utility>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+
+///////////////////////////
+///                     ///
+///      CONSTANTS      ///
+///                     ///
+///////////////////////////
+
+
+constexpr char MAGIC[4] = {'T', 'S', 'S', 'L'};
+constexpr std::size_t HEADER_SIZE = sizeof(MAGIC) + 4 + 8;
+
+
+///////////////////////////
+///                     ///
+///     AUXILIARY       ///
+///     FUNCTIONS       ///
+///                     ///
+///////////////////////////
+
+
+namespace {
+    uint64_t fnv1a(const char *bytes, std::size_t length) noexcept {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (std::size_t i = 0; i < length; ++i) {
+            hash ^= static_cast<uint8_t>(bytes[i]);
+            hash *= 0x100000001b3ULL;
+        }
+        return hash;
+    }
+
+    void append_varint(std::string &bytes, uint64_t value) {
+        while (value >= 0x80) {
+            bytes.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        bytes.push_back(static_cast<char>(value));
+    }
+
+    uint64_t zigzag(uint64_t difference) noexcept {
+        return (difference << 1) ^ static_cast<uint64_t>(static_cast<int64_t>(difference) >> 63);
+    }
+
+    void encode_column(const std::vector<uint64_t> &values, std::string &bytes) {
+        if (values.empty())
+            return;
+        append_varint(bytes, values[0]);
+        for (std::size_t i = 1; i < values.size(); ++i)
+            append_varint(bytes, zigzag(values[i] - values[i - 1]));
+    }
+
+    bool write_all(int fd, const std::string &bytes, uint64_t offset) {
+        std::size_t written = 0;
+        while (written < bytes.size()) {
+            const ssize_t result = pwrite(fd, bytes.data() + written,
+                                          bytes.size() - written, offset + written);
+            if (result < 0 && errno != EINTR)
+                return false;
+            if (result == 0) {
+                // Would never make progress.
+                errno = EIO;
+                return false;
+            }
+            if (result > 0)
+                written += result;
+        }
+        return true;
+    }
+
+    bool read_all(int fd, char *bytes, std::size_t length, uint64_t offset) {
+        std::size_t read = 0;
+        while (read < length) {
+            const ssize_t result = pread(fd, bytes + read, length - read, offset + read);
+            if (result < 0 && errno != EINTR)
+                return false;
+            if (result == 0)
+                return false;
+            if (result > 0)
+                read += result;
+        }
+        return true;
+    }
+
+    // can throw
+    // The size of the whole blocks at the start of the file, those after
+    // (if any) having been cut off by a crash while writing them.
+    uint64_t valid_size(int fd, uint64_t size) {
+        std::string header(HEADER_SIZE, '\0');
+        std::string payload;
+        // Even a file cut off within the first header starts with (a part of) it.
+        const std::size_t start = std::min<uint64_t>(size, sizeof(MAGIC));
+        if (!read_all(fd, header.data(), start, 0))
+            throw LedgerError("Could not read the ledger file");
+        if (memcmp(header.data(), MAGIC, start))
+            throw LedgerError("Not a ledger file");
+
+        uint64_t offset = 0;
+        while (offset + HEADER_SIZE <= size) {
+            if (!read_all(fd, header.data(), HEADER_SIZE, offset))
+                throw LedgerError("Could not read the ledger file");
+            if (memcmp(header.data(), MAGIC, sizeof(MAGIC)))
+                break;
+            uint32_t length;
+            uint64_t hash;
+            memcpy(&length, header.data() + sizeof(MAGIC), sizeof(length));
+            memcpy(&hash, header.data() + sizeof(MAGIC) + sizeof(length), sizeof(hash));
+            if (offset + HEADER_SIZE + length > size)
+                break;
+            payload.resize(length);
+            if (!read_all(fd, payload.data(), length, offset + HEADER_SIZE))
+                throw LedgerError("Could not read the ledger file");
+            if (fnv1a(payload.data(), length) != hash)
+                break;
+            offset += HEADER_SIZE + length;
+        }
+        return offset;
+    }
+}
+
+
+///////////////////////////
+///                     ///
+///    SALES LEDGER     ///
+///                     ///
+///////////////////////////
+
+
+SalesLedger::SalesLedger(const std::string &path, uint64_t flush_interval)
+: m_fd{open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644)}
+, m_size{0}
+, m_flush_interval{flush_interval}
+, m_block_time{0}
+, m_stopping{false}
+, m_rows_written{0}
+, m_write_failures{0}
+{
+    const off_t size = m_fd < 0 ? -1 : lseek(m_fd, 0, SEEK_END);
+    if (size < 0) {
+        if (m_fd >= 0)
+            close(m_fd);
+        throw LedgerError("Could not open the ledger file: " + path);
+    }
+    try {
+        m_size = valid_size(m_fd, size);
+    } catch (const LedgerError &e) {
+        close(m_fd);
+        throw LedgerError(std::string{e.what()} + ": " + path);
+    }
+    if (m_size < static_cast<uint64_t>(size)) {
+        std::cerr << "Cutting off " << size - m_size
+                  << " bytes of a partly written block from the ledger.\n";
+        if (ftruncate(m_fd, m_size) < 0 || fsync(m_fd) < 0) {
+            close(m_fd);
+            throw LedgerError("Could not cut off the partly written block: " + path);
+        }
+    }
+    for (auto &column : m_block)
+        column.reserve(BLOCK_ROWS);
+    m_writer = std::thread([this] { write_blocks(); });
+}
+
+SalesLedger::~SalesLedger() {
+    try {
+        flush();
+    } catch (const LedgerError &e) {
+        std::cerr << e.what() << "\n";
+    }
+    {
+        std::lock_guard lock(m_mutex);
+        m_stopping = true;
+    }
+    m_wakeup.notify_one();
+    m_writer.join();
+    close(m_fd);
+}
+
+// can throw
+void SalesLedger::append(const Sale &sale, uint64_t client, uint64_t now) {
+    if (m_block[0].empty())
+        m_block_time = now;
+
+    const uint64_t row[COLUMNS] = {
+        sale.reservation_id, sale.event_id, sale.category, sale.first_ticket,
+        sale.ticket_count, client, sale.reservation_time, sale.collection_time
+    };
+    for (std::size_t column = 0; column < COLUMNS; ++column)
+        m_block[column].push_back(row[column]);
+
+    if (m_block[0].size() >= BLOCK_ROWS)
+        flush();
+}
+
+// can throw
+void SalesLedger::flush_if_stale(uint64_t now) {
+    if (!m_block[0].empty() && now - m_block_time >= m_flush_interval)
+        flush();
+}
+
+// can throw
+void SalesLedger::flush() {
+    if (m_block[0].empty())
+        return;
+
+    Block block;
+    {
+        std::lock_guard lock(m_mutex);
+        if (m_pending.size() >= MAX_PENDING_BLOCKS)
+            throw LedgerError("The ledger has fallen behind: writing it keeps failing.");
+        if (!m_free.empty()) {
+            block = std::move(m_free.back());
+            m_free.pop_back();
+        }
+    }
+    for (auto &column : block)
+        column.reserve(BLOCK_ROWS);
+    std::swap(block, m_block);
+    {
+        std::lock_guard lock(m_mutex);
+        m_pending.push_back(std::move(block));
+    }
+    m_wakeup.notify_one();
+}
+
+void SalesLedger::write_blocks() {
+    std::string bytes;
+    std::string columns[COLUMNS];
+    while (true) {
+        Block block;
+        {
+            std::unique_lock lock(m_mutex);
+            m_wakeup.wait(lock, [this] { return m_stopping || !m_pending.empty(); });
+            if (m_pending.empty())
+                return;
+            block = std::move(m_pending.front());
+            m_pending.pop_front();
+        }
+
+        bytes.assign(HEADER_SIZE, '\0');
+        append_varint(bytes, block[0].size());
+        for (std::size_t column = 0; column < COLUMNS; ++column) {
+            columns[column].clear();
+            encode_column(block[column], columns[column]);
+            append_varint(bytes, columns[column].size());
+        }
+        for (const auto &column : columns)
+            bytes += column;
+        const uint32_t length = bytes.size() - HEADER_SIZE;
+        const uint64_t hash = fnv1a(bytes.data() + HEADER_SIZE, length);
+        memcpy(bytes.data(), MAGIC, sizeof(MAGIC));
+        memcpy(bytes.data() + sizeof(MAGIC), &length, sizeof(length));
+        memcpy(bytes.data() + sizeof(MAGIC) + sizeof(length), &hash, sizeof(hash));
+
+        while (!write_block(bytes)) {
+            m_write_failures.fetch_add(1, std::memory_order_relaxed);
+            std::unique_lock lock(m_mutex);
+            if (m_wakeup.wait_for(lock, RETRY_DELAY, [this] { return m_stopping; })) {
+                std::cerr << "Giving up on the ledger, " << m_pending.size() + 1
+                          << " blocks of sales are lost.\n";
+                return;
+            }
+        }
+        m_size += bytes.size();
+        m_rows_written.fetch_add(block[0].size(), std::memory_order_relaxed);
+
+        for (auto &column : block)
+            column.clear();
+        std::lock_guard lock(m_mutex);
+        m_free.push_back(std::move(block));
+    }
+}
+
+// Writes `bytes` after the blocks written so far and syncs them. What
+// a failed attempt has written is cut off, or else overwritten by the
+// next one.
+bool SalesLedger::write_block(const std::string &bytes) {
+    if (write_all(m_fd, bytes, m_size) && fsync(m_fd) == 0)
+        return true;
+    std::cerr << "Writing the ledger has failed: " << strerror(errno) << "\n";
+    if (ftruncate(m_fd, m_size) < 0)
+        std::cerr << "Cutting off the partly written block has failed too.\n";
+    return false;
+}
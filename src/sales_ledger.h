@@ -0,0 +1,105 @@
+#ifndef __SALES_LEDGER_H__
+#define __SALES_LEDGER_H__
+
+#include "database.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+class LedgerError : public std::runtime_error {
+public:
+    LedgerError(const std::string &what_arg)
+    : std::runtime_error{what_arg} {}
+};
+
+// Append-only file of every sale, for reconciliation. Rows are collected
+// by column in memory and handed, a block at a time, to a thread that
+// encodes and writes them, so appending a row costs a few stores. Every
+// block is synced once written. A block that fails to be written is
+// retried until it is; if blocks pile up behind it meanwhile, appending
+// throws rather than keeping every sale in memory.
+//
+// The file is a sequence of blocks, each framed so that one cut off by a
+// crash is detected (and cut off too) when the file is opened again:
+//   4 bytes "TSSL"
+//   uint32  length of the rest of the block
+//   uint64  FNV-1a hash of the rest of the block
+//   varint  row count
+//   varint  encoded length of every column, in column order
+//   bytes   the columns, in column order
+// A column holds the value of its first row as a varint, followed by the
+// differences between consecutive rows as zigzag varints. The columns
+// are: reservation ID, event ID, category, first ticket (counter value),
+// ticket count, client (address_to_id()), reservation time and
+// collection time (seconds).
+class SalesLedger {
+public:
+    static constexpr std::size_t COLUMNS = 8;
+    static constexpr std::size_t BLOCK_ROWS = 1 << 16;
+    // Blocks waiting to be written, beyond which appending throws.
+    static constexpr std::size_t MAX_PENDING_BLOCKS = 16;
+    static constexpr std::chrono::seconds RETRY_DELAY{1};
+
+private:
+    using Block = std::array<std::vector<uint64_t>, COLUMNS>;
+
+    const int                   m_fd;
+    uint64_t                    m_size; // of the blocks written, writer only
+    const uint64_t              m_flush_interval;
+    Block                       m_block;
+    uint64_t                    m_block_time; // of the block's first row
+
+    std::mutex                  m_mutex;
+    std::condition_variable     m_wakeup;
+    std::deque<Block>           m_pending;
+    std::vector<Block>          m_free; // written blocks, kept for reuse
+    bool                        m_stopping;
+    std::atomic<uint64_t>       m_rows_written;
+    std::atomic<uint64_t>       m_write_failures;
+    std::thread                 m_writer;
+
+public:
+    SalesLedger() = delete;
+    // can throw
+    // Rows are written at the latest `flush_interval` seconds after being
+    // appended, as long as flush_if_stale() is called regularly.
+    SalesLedger(const std::string &path, uint64_t flush_interval);
+    // Writes the remaining rows (trying each block once more at most).
+    ~SalesLedger();
+
+    SalesLedger(const SalesLedger&) = delete;
+    SalesLedger &operator=(const SalesLedger&) = delete;
+
+    // can throw
+    void append(const Sale &sale, uint64_t client, uint64_t now);
+
+    // can throw
+    void flush_if_stale(uint64_t now);
+
+    // Safe to call from any thread.
+    uint64_t rows_written() const noexcept {
+        return m_rows_written.load(std::memory_order_relaxed);
+    }
+
+    // Safe to call from any thread.
+    uint64_t write_failures() const noexcept {
+        return m_write_failures.load(std::memory_order_relaxed);
+    }
+
+private:
+    // can throw
+    void flush();
+    void write_blocks();
+    bool write_block(const std::string &bytes);
+};
+
+#endif // __SALES_LEDGER_H__
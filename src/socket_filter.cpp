@@ -0,0 +1,154 @@
+#include "socket_filter.h"
+
+#include <cerrno>
+#include <cstring> // std::strerror
+
+#include <linux/sock_diag.h> // SK_MEMINFO_*
+#include <sys/socket.h>
+
+
+///////////////////////////
+///                     ///
+///      CONSTANTS      ///
+///                     ///
+///////////////////////////
+
+
+// The filter sees the datagram starting with its UDP header.
+constexpr uint32_t PAYLOAD_OFFSET = 8;
+constexpr uint32_t ACCEPT = UINT32_MAX; // bytes kept
+constexpr uint32_t DROP = 0;
+// Scratch memory cells.
+constexpr uint32_t LENGTH_CELL = 0;
+constexpr uint32_t EXPECTED_CELL = 1;
+
+
+///////////////////////////
+///                     ///
+///     AUXILIARY       ///
+///     FUNCTIONS       ///
+///                     ///
+///////////////////////////
+
+
+namespace {
+    sock_filter statement(uint16_t code, uint32_t k) noexcept {
+        return sock_filter{code, 0, 0, k};
+    }
+
+    sock_filter jump(uint16_t code, uint32_t k, uint8_t jump_true, uint8_t jump_false) noexcept {
+        return sock_filter{code, jump_true, jump_false, k};
+    }
+}
+
+
+///////////////////////////
+///                     ///
+///    SOCKET FILTER    ///
+///                     ///
+///////////////////////////
+
+
+// The payload offset is kept in X (past the prefix, if any) and the payload
+// length in LENGTH_CELL. The message ID selects a block checking the
+// length; every block ends in its own return, so all conditional jumps
+// stay short.
+std::vector<sock_filter> build_socket_filter(const std::vector<MessageRule> &rules,
+                                             std::size_t max_length,
+                                             uint8_t prefix_id, std::size_t prefix_length)
+{
+    std::vector<sock_filter> program{
+        statement(BPF_LD | BPF_W | BPF_LEN, 0),
+        jump(BPF_JMP | BPF_JGT | BPF_K, PAYLOAD_OFFSET + max_length, 0, 1),
+        statement(BPF_RET | BPF_K, DROP),
+        jump(BPF_JMP | BPF_JGE | BPF_K, PAYLOAD_OFFSET + 1, 1, 0),
+        statement(BPF_RET | BPF_K, DROP),
+
+        statement(BPF_LDX | BPF_W | BPF_IMM, 0),
+        statement(BPF_LD | BPF_B | BPF_ABS, PAYLOAD_OFFSET),
+        jump(BPF_JMP | BPF_JEQ | BPF_K, prefix_id, 0, 4),
+        statement(BPF_LD | BPF_W | BPF_LEN, 0),
+        jump(BPF_JMP | BPF_JGE | BPF_K, PAYLOAD_OFFSET + prefix_length + 1, 1, 0),
+        statement(BPF_RET | BPF_K, DROP),
+        statement(BPF_LDX | BPF_W | BPF_IMM, static_cast<uint32_t>(prefix_length)),
+
+        statement(BPF_LD | BPF_W | BPF_LEN, 0),
+        statement(BPF_ALU | BPF_SUB | BPF_X, 0),
+        statement(BPF_ALU | BPF_SUB | BPF_K, PAYLOAD_OFFSET),
+        statement(BPF_ST, LENGTH_CELL),
+        statement(BPF_LD | BPF_B | BPF_IND, PAYLOAD_OFFSET),
+    };
+
+    // Dispatch: a test and a jump to the rule's block for every rule.
+    const std::size_t dispatch = program.size();
+    for (const MessageRule &rule : rules) {
+        program.push_back(jump(BPF_JMP | BPF_JEQ | BPF_K, rule.message_id, 0, 1));
+        program.push_back(statement(BPF_JMP | BPF_JA, 0)); // patched below
+    }
+    program.push_back(statement(BPF_RET | BPF_K, DROP));
+
+    for (std::size_t i = 0; i < rules.size(); ++i) {
+        const MessageRule &rule = rules[i];
+        const std::size_t jump_index = dispatch + 2 * i + 1;
+        program[jump_index].k = program.size() - jump_index - 1;
+
+        if (rule.item_size) {
+            program.push_back(statement(BPF_LD | BPF_B | BPF_IND, PAYLOAD_OFFSET + 1));
+            program.push_back(statement(BPF_ALU | BPF_MUL | BPF_K, rule.item_size));
+            program.push_back(statement(BPF_ALU | BPF_ADD | BPF_K, rule.length));
+            program.push_back(statement(BPF_ST, EXPECTED_CELL));
+            program.push_back(statement(BPF_LDX | BPF_W | BPF_MEM, EXPECTED_CELL));
+            program.push_back(statement(BPF_LD | BPF_W | BPF_MEM, LENGTH_CELL));
+            program.push_back(jump(BPF_JMP | BPF_JEQ | BPF_X, 0, 0, 1));
+        } else {
+            program.push_back(statement(BPF_LD | BPF_W | BPF_MEM, LENGTH_CELL));
+            if (rule.extended_length)
+                program.push_back(jump(BPF_JMP | BPF_JEQ | BPF_K, rule.extended_length, 1, 0));
+            program.push_back(jump(BPF_JMP | BPF_JEQ | BPF_K, rule.length, 0, 1));
+        }
+        program.push_back(statement(BPF_RET | BPF_K, ACCEPT));
+        program.push_back(statement(BPF_RET | BPF_K, DROP));
+    }
+
+    if (program.size() > BPF_MAXINSNS)
+        throw SocketFilterError("The socket filter is too long.");
+    return program;
+}
+
+void attach_socket_filter(int socket_fd, const std::vector<sock_filter> &program) {
+    sock_fprog filter{
+        static_cast<unsigned short>(program.size()),
+        const_cast<sock_filter*>(program.data())
+    };
+    if (setsockopt(socket_fd, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)))
+        throw SocketFilterError(std::string{"Attaching the socket filter has failed: "}
+                                + std::strerror(errno) + ".");
+}
+
+bool matches_rules(const std::vector<MessageRule> &rules,
+                   char const *payload, std::size_t length) noexcept
+{
+    if (!length)
+        return false;
+    const uint8_t message_id = payload[0];
+    for (const MessageRule &rule : rules) {
+        if (rule.message_id != message_id)
+            continue;
+        if (rule.item_size)
+            return length >= 2
+                   && length == rule.length + rule.item_size * static_cast<uint8_t>(payload[1]);
+        return length == rule.length || (rule.extended_length && length == rule.extended_length);
+    }
+    return false;
+}
+
+uint64_t socket_drops(int socket_fd) noexcept {
+    uint32_t memory_info[SK_MEMINFO_VARS] = {};
+    socklen_t length = sizeof(memory_info);
+    if (getsockopt(socket_fd, SOL_SOCKET, SO_MEMINFO, memory_info, &length)
+        || length <= SK_MEMINFO_DROPS * sizeof(uint32_t))
+    {
+        return 0;
+    }
+    return memory_info[SK_MEMINFO_DROPS];
+}
@@ -0,0 +1,50 @@
+#ifndef __SOCKET_FILTER_H__
+#define __SOCKET_FILTER_H__
+
+#include <cstdint>
+#include <cstdlib> // std::size_t
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <linux/filter.h>
+
+class SocketFilterError : public std::runtime_error {
+public:
+    SocketFilterError(const std::string &what_arg)
+    : std::runtime_error{what_arg} {}
+};
+
+// Lengths of the datagrams (UDP payloads) accepted for a message ID, the
+// payload's first byte.
+struct MessageRule {
+    uint8_t     message_id;
+    std::size_t length;
+    std::size_t extended_length = 0;    // also accepted, 0 - none
+    // If nonzero, the length is `length` plus `item_size` times the
+    // payload's second byte (an item count), and `extended_length` is unused.
+    std::size_t item_size = 0;
+};
+
+// Classic BPF program for a UDP socket, dropping in the kernel the
+// datagrams longer than `max_length` or not matching any of the rules.
+// A datagram starting with `prefix_id` is checked as if its first
+// `prefix_length` bytes were not there.
+// can throw
+std::vector<sock_filter> build_socket_filter(const std::vector<MessageRule> &rules,
+                                             std::size_t max_length,
+                                             uint8_t prefix_id, std::size_t prefix_length);
+
+// can throw
+void attach_socket_filter(int socket_fd, const std::vector<sock_filter> &program);
+
+// Whether a payload (past the prefix, if any) matches one of the rules,
+// the same check the filter does in the kernel. Lets the receiver apply
+// the rules the filter was built from rather than a copy of them.
+bool matches_rules(const std::vector<MessageRule> &rules,
+                   char const *payload, std::size_t length) noexcept;
+
+// Datagrams dropped by the socket, by its filter or for lack of buffer space.
+uint64_t socket_drops(int socket_fd) noexcept;
+
+#endif // __SOCKET_FILTER_H__
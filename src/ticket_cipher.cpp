@@ -0,0 +1,91 @@
+#include "ticket_cipher.h"
+
+#include <utility> // std::swap
+
+
+///////////////////////////
+///                     ///
+///      CONSTANTS      ///
+///                     ///
+///////////////////////////
+
+
+constexpr uint64_t KEY_STEP = 0x9e3779b97f4a7c15ULL;
+constexpr int DIGIT_BASE = 36;
+
+
+///////////////////////////
+///                     ///
+///    TICKET CIPHER    ///
+///                     ///
+///////////////////////////
+
+
+TicketCipher::TicketCipher(uint64_t key) noexcept
+: m_enabled{key != 0}
+{
+    for (int round = 0; round < ROUNDS; ++round)
+        m_round_keys[round] = mix(key + (round + 1) * KEY_STEP);
+}
+
+// Each round adds the round value of one half to the other, and the halves
+// swap places, so their ranges alternate between 36^4 and 36^3.
+uint64_t TicketCipher::encrypt(uint64_t value) const noexcept {
+    if (!m_enabled)
+        return value;
+
+    uint32_t left = value / LOW_SIZE;   // in [0, HIGH_SIZE)
+    uint32_t right = value % LOW_SIZE;  // in [0, LOW_SIZE)
+    uint32_t left_size = HIGH_SIZE;
+    uint32_t right_size = LOW_SIZE;
+    for (int round = 0; round < ROUNDS; ++round) {
+        const uint32_t sum = (left + round_value(round, right, left_size)) % left_size;
+        left = right;
+        right = sum;
+        std::swap(left_size, right_size);
+    }
+    return uint64_t{left} * LOW_SIZE + right;
+}
+
+uint64_t TicketCipher::decrypt(uint64_t value) const noexcept {
+    if (!m_enabled)
+        return value;
+
+    uint32_t left = value / LOW_SIZE;
+    uint32_t right = value % LOW_SIZE;
+    uint32_t left_size = HIGH_SIZE;
+    uint32_t right_size = LOW_SIZE;
+    for (int round = ROUNDS - 1; round >= 0; --round) {
+        // The round turned (previous left, left) into (left, right).
+        std::swap(left_size, right_size);
+        const uint32_t difference = round_value(round, left, left_size);
+        const uint32_t previous_left = (right + left_size - difference) % left_size;
+        right = left;
+        left = previous_left;
+    }
+    return uint64_t{left} * LOW_SIZE + right;
+}
+
+void TicketCipher::encode(uint64_t value, char *code) noexcept {
+    for (int i = 0; i < TICKET_LEN; ++i) {
+        const int digit = value % DIGIT_BASE;
+        value /= DIGIT_BASE;
+        code[i] = (digit > 9) ? 'A' + digit - 10 : '0' + digit;
+    }
+}
+
+uint64_t TicketCipher::decode(char const *code) noexcept {
+    uint64_t value = 0;
+    for (int i = TICKET_LEN - 1; i >= 0; --i) {
+        const char c = code[i];
+        int digit;
+        if (c >= '0' && c <= '9')
+            digit = c - '0';
+        else if (c >= 'A' && c <= 'Z')
+            digit = c - 'A' + 10;
+        else
+            return DOMAIN_SIZE;
+        value = value * DIGIT_BASE + digit;
+    }
+    return value;
+}
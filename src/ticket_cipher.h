@@ -0,0 +1,65 @@
+#ifndef __TICKET_CIPHER_H__
+#define __TICKET_CIPHER_H__
+
+#include "common.h"
+
+#include <cstdint>
+
+// Keyed permutation of the ticket code space: every number below
+// 36^TICKET_LEN maps to a distinct one in the same range, so codes handed
+// out for consecutive counter values give away nothing about each other.
+//
+// The domain is split into a 36^3 and a 36^4 half and run through an
+// unbalanced (alternating) Feistel network. A zero key disables it, and
+// counters map to themselves.
+class TicketCipher {
+public:
+    static constexpr uint64_t DOMAIN_SIZE = 78364164096ULL; // 36^7
+    static constexpr int ROUNDS = 8;
+
+private:
+    static constexpr uint32_t LOW_SIZE = 36 * 36 * 36 * 36;
+    static constexpr uint32_t HIGH_SIZE = 36 * 36 * 36;
+    static_assert(uint64_t{LOW_SIZE} * HIGH_SIZE == DOMAIN_SIZE);
+    static_assert(ROUNDS % 2 == 0, "the halves have to end up where they started");
+
+    uint64_t m_round_keys[ROUNDS] = {};
+    bool     m_enabled = false;
+
+public:
+    TicketCipher() = default;
+    explicit TicketCipher(uint64_t key) noexcept;
+    ~TicketCipher() = default;
+
+    bool enabled() const noexcept {
+        return m_enabled;
+    }
+
+    // `value` has to be below DOMAIN_SIZE.
+    uint64_t encrypt(uint64_t value) const noexcept;
+    uint64_t decrypt(uint64_t value) const noexcept;
+
+    // Base-36 digits, least significant first.
+    static void encode(uint64_t value, char *code) noexcept;
+    // Returns DOMAIN_SIZE if `code` is not a valid ticket code.
+    static uint64_t decode(char const *code) noexcept;
+
+private:
+    static uint64_t mix(uint64_t x) noexcept {
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdULL;
+        x ^= x >> 33;
+        x *= 0xc4ceb9fe1a85ec53ULL;
+        x ^= x >> 33;
+        return x;
+    }
+
+    // Round function of round `round`, mapped onto [0, range).
+    uint32_t round_value(int round, uint32_t half, uint32_t range) const noexcept {
+        return static_cast<uint32_t>(
+            (static_cast<unsigned __int128>(mix(half ^ m_round_keys[round])) * range) >> 64
+        );
+    }
+};
+
+#endif // __TICKET_CIPHER_H__
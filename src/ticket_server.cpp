@@ -1,52 +1,1060 @@
+#include "address_token.h"
+#include "batch_controller.h"
+#include "catalog_loader.h"
+#include "checkpoint.h"
 #include "common.h"
 #include "database.h"
+#include "event_fragments.h"
+#include "fair_scheduler.h"
+#include "latency_histogram.h"
+#include "mapped_store.h"
+#include "metrics.h"
 #include "networking.h"
+#include "profiler.h"
+#include "sales_ledger.h"
+#include "socket_filter.h"
 
 #include <iostream>
 #include <fstream>
 #include <filesystem>
 
 #include <cstdint>
+#include <climits> // IOV_MAX
 #include <cstdlib> // std::size_t
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <random>
+#include <stdexcept>
 #include <string>
 
-constexpr std::size_t MAX_REQUEST_SIZE = 53;
+#include <signal.h>
+
+constexpr std::size_t MAX_SEARCH_QUERY_LEN = 255;
+constexpr std::size_t MAX_AVAILABILITY_IDS = 255;
+// Message ID and address token.
+constexpr std::size_t VERIFIED_HEADER_SIZE = 1 + 8;
+constexpr std::size_t TOKEN_SIZE = 1 + 8;
+constexpr std::size_t MAX_REQUEST_SIZE = VERIFIED_HEADER_SIZE + 1 + 1 + 4 * MAX_AVAILABILITY_IDS;
+// With address verification, unverified addresses get replies at most
+// this many times larger than their requests, so that spoofed requests
+// cannot turn the server into an amplifier.
+constexpr std::size_t MAX_AMPLIFICATION = 3;
+
+// Datagrams received with a single syscall, see BatchController.
+constexpr std::size_t MIN_BATCH_SIZE = 1;
+constexpr std::size_t BATCH_SIZE = 64;
+constexpr std::size_t BATCH_INCREASE = 4;
+// Empty receives in a row before the loop goes back to blocking.
+constexpr std::size_t POLL_LIMIT = 64;
+// Partner requests served per iteration, on top of the public ones (at
+// most BATCH_SIZE), so that a flood of the partner port cannot starve
+// the public one.
+constexpr std::size_t PARTNER_BUDGET = BATCH_SIZE;
+// Requests waiting to be served, see FairScheduler.
+constexpr std::size_t SCHEDULER_SLOTS = 4096;
+constexpr std::size_t SCHEDULER_FLOWS = 1024;
+constexpr uint32_t MAX_FLOW_LENGTH = 64;
+// Relative cost of serving a request, see request_cost().
+constexpr uint32_t MAX_REQUEST_COST = 8;
+// Keeps SEARCH_RESULT within a single small datagram.
+constexpr std::size_t MAX_SEARCH_RESULTS = 128;
+// As many as the shortest EVENTS entries that fit in a datagram.
+constexpr std::size_t MAX_LISTED_EVENTS = (MAX_CONTENT_SIZE - 1) / (4 + 2 + 1);
+
+constexpr std::size_t GET_EVENTS_SIZE = 1;
+// GET_EVENTS may name the first event to list.
+constexpr std::size_t FIRST_EVENT_SIZE = 4;
+constexpr std::size_t GET_RESERVATION_SIZE = 1 + 4 + 2;
+// Reservation requests may name a ticket category.
+constexpr std::size_t CATEGORY_SIZE = 1;
+constexpr std::size_t GET_TICKETS_SIZE = 1 + 4 + COOKIE_LEN;
+constexpr std::size_t CAPABILITIES_SIZE = 1;
+constexpr std::size_t GET_RESERVATION_EXTERNAL_SIZE = 1 + 8 + 2;
+constexpr std::size_t GET_EVENT_CATEGORIES_SIZE = 1;
+constexpr std::size_t GET_LARGE_RESERVATION_SIZE = 1 + 4 + 4;
+constexpr std::size_t GET_TICKET_CHUNK_SIZE = 1 + 4 + COOKIE_LEN + 4;
+constexpr std::size_t WAITLIST_SIZE = 1 + 4 + 2;
+constexpr std::size_t GET_CATALOG_SIZE = 1 + 4;
+constexpr std::size_t GET_COUNTS_SIZE = 1 + 4 + 4;
+constexpr std::size_t CHECK_TICKET_SIZE = 1 + TICKET_LEN;
+// Padded to the size of TOKEN, which is then no larger than the request.
+constexpr std::size_t GET_TOKEN_SIZE = TOKEN_SIZE;
+// Message ID, catalog version, first event ID and event count.
+constexpr std::size_t CATALOG_HEADER_SIZE = 1 + 4 + 4 + 4;
+
+
+constexpr int DEFAULT_PORT = 2022;
+constexpr uint64_t DEFAULT_TIMEOUT = 5;
+constexpr uint64_t MAX_TIMEOUT = 86400;
+constexpr unsigned MAX_PROFILE_FREQUENCY = 10000;
+// Longest time (in seconds) a sale waits before being written to the ledger.
+constexpr uint64_t LEDGER_FLUSH_INTERVAL = 5;
+// Seconds between checkpoints, and checkpoints merged into a new base.
+constexpr uint64_t CHECKPOINT_INTERVAL = 10;
+constexpr std::size_t CHECKPOINT_MERGE_AFTER = 32;
+// Longest time (in milliseconds) between commits to the mapped store, and
+// so the changes a crash can lose.
+constexpr uint64_t STORE_COMMIT_INTERVAL = 100;
+// Longest time (in milliseconds) the server waits for requests while sales
+// or changes wait to be written, so that they are written without traffic.
+constexpr int IDLE_WAKEUP_INTERVAL = 1000;
+
+// `kill -USR1` writes the profile collected so far to this file.
+constexpr int PROFILE_EXPORT_SIGNAL = SIGUSR1;
+constexpr char PROFILE_EXPORT_PATH[] = "ticket_server.folded";
+// `kill -USR2` writes the current metrics to this file.
+constexpr int METRICS_EXPORT_SIGNAL = SIGUSR2;
+constexpr char METRICS_EXPORT_PATH[] = "ticket_server.metrics";
 
 struct ServerParameters {
     std::string filepath;
-    int port;
-    uint64_t timeout;
+    int port = DEFAULT_PORT;
+    uint64_t timeout = DEFAULT_TIMEOUT;
+    unsigned profile_frequency = 0; // samples per second of CPU time, 0 - off
+    uint64_t ticket_key = 0; // 0 - consecutive ticket codes
+    bool ticket_key_given = false; // rather than drawn at random
+    int partner_port = 0; // 0 - no partner socket
+    std::string ledger_path; // empty - no ledger
+    std::string checkpoint_path; // empty - no checkpoints
+    std::string store_path; // empty - no mapped store
+    bool verify_addresses = false; // serve state changes to verified addresses only
+};
+
+// Kept by the loop for serving requests, so that serving one does not
+// allocate them.
+struct ServeBuffers {
+    NetworkWriter       writer{MAX_CONTENT_SIZE};
+    std::vector<iovec>  listing; // replies assembled from event fragments
+    std::vector<Sale>   sales;
 };
 
+[[noreturn]] void parameter_error(const std::string &message) {
+    std::cerr << message << "\n"
+              << "Usage: ticket_server -f <file> [-p <port>] [-t <timeout>] "
+                 "[-s <profile frequency>] [-k <ticket key>] [-P <partner port>] "
+                 "[-l <ledger file>] [-c <checkpoint directory>] "
+                 "[-m <store file>] [-v <verify addresses: 0 or 1>]\n";
+    exit(1);
+}
+
+uint64_t parse_number(const char *value, uint64_t min, uint64_t max) {
+    char *end;
+    errno = 0;
+    const unsigned long long result = strtoull(value, &end, 10);
+    if (errno || *end || end == value || value[0] == '-' || result < min || result > max)
+        parameter_error(std::string{"Invalid value: "} + value);
+    return result;
+}
+
 ServerParameters parse_parameters(int argc, char *argv[]) {
-    return ServerParameters(); // TODO
+    ServerParameters result;
+    bool has_file = false;
+
+    for (int i = 0; i < argc; i += 2) {
+        const std::string flag = argv[i];
+        if (i + 1 >= argc)
+            parameter_error("Missing value for " + flag);
+        const char *value = argv[i + 1];
+
+        if (flag == "-f") {
+            result.filepath = value;
+            has_file = true;
+        } else if (flag == "-p") {
+            result.port = parse_number(value, 0, UINT16_MAX);
+        } else if (flag == "-t") {
+            result.timeout = parse_number(value, 1, MAX_TIMEOUT);
+        } else if (flag == "-s") {
+            result.profile_frequency = parse_number(value, 0, MAX_PROFILE_FREQUENCY);
+        } else if (flag == "-l") {
+            result.ledger_path = value;
+        } else if (flag == "-c") {
+            result.checkpoint_path = value;
+        } else if (flag == "-m") {
+            result.store_path = value;
+        } else if (flag == "-P") {
+            result.partner_port = parse_number(value, 1, UINT16_MAX);
+        } else if (flag == "-v") {
+            result.verify_addresses = parse_number(value, 0, 1);
+        } else if (flag == "-k") {
+            result.ticket_key = parse_number(value, 0, UINT64_MAX);
+            result.ticket_key_given = true;
+        } else {
+            parameter_error("Unknown flag: " + flag);
+        }
+    }
+
+    if (!has_file)
+        parameter_error("The events file has not been specified.");
+    if (!std::filesystem::is_regular_file(result.filepath))
+        parameter_error("The events file does not exist: " + result.filepath);
+    if (result.partner_port == result.port)
+        parameter_error("The partner port has to differ from the public one.");
+    // Both would take the same dirty pages.
+    if (!result.checkpoint_path.empty() && !result.store_path.empty())
+        parameter_error("Checkpoints and a mapped store cannot be used together.");
+
+    // Without a key given, codes are unguessable, but differ between runs
+    // (unless the key is restored with the rest of the state).
+    if (!result.ticket_key_given) {
+        std::random_device random;
+        while (!result.ticket_key)
+            result.ticket_key = static_cast<uint64_t>(random()) << 32 | random();
+    }
+
+    return result;
+}
+
+// The catalog is indexed once it has been loaded, see CatalogLoader.
+bool catalog_loading(const Database &db) noexcept {
+    return db.get_catalog_version() == 0;
+}
+
+bool event_loading(const Database &db, uint32_t event_id) noexcept {
+    return catalog_loading(db) && event_id >= db.event_count();
+}
+
+// can throw
+// Restores `pages` (ordered by kind and index) from `next` on, as far as
+// the events added so far allow, see Database::restorable(). Releases
+// them once all have been restored.
+void restore_pages(Database &db, std::vector<StatePage> &pages, std::size_t &next) {
+    try {
+        for (; next < pages.size() && db.restorable(pages[next]); ++next)
+            db.restore_page(pages[next]);
+    } catch (const InvalidStatePage&) {
+        throw std::runtime_error("The restored state does not match the events file.");
+    }
+    if (next == pages.size()) {
+        std::vector<StatePage>().swap(pages);
+        next = 0;
+    }
+}
+
+void write_retry_later(Database &db, NetworkWriter &writer) {
+    writer.add_number(RETRY_LATER);
+    writer.add_number(static_cast<uint32_t>(db.event_count()));
+}
+
+// EVENTS listings point into the entries pre-serialized in `fragments`,
+// so only the header and the ticket counts are written per request.
+// Counts above the field's range are reported as its maximum.
+void gather_events(Database &db, EventFragments &fragments, std::vector<iovec> &listing,
+                   uint32_t first_event_id)
+{
+    static const uint8_t header = EVENTS;
+    listing.push_back(iovec{const_cast<uint8_t*>(&header), sizeof(header)});
+    if (first_event_id < fragments.size())
+        fragments.gather_range(db, first_event_id, fragments.size() - first_event_id,
+                               MAX_CONTENT_SIZE - sizeof(header), IOV_MAX - 1, listing);
+}
+
+void gather_search_events(Database &db, EventFragments &fragments,
+                          std::vector<iovec> &listing, std::string_view query)
+{
+    static const uint8_t header = EVENTS;
+    std::vector<uint32_t> event_ids;
+    db.search_events(query, MAX_LISTED_EVENTS, event_ids);
+    listing.push_back(iovec{const_cast<uint8_t*>(&header), sizeof(header)});
+    fragments.gather(db, event_ids.data(), event_ids.size(),
+                     MAX_CONTENT_SIZE - sizeof(header), IOV_MAX - 1, listing);
+}
+
+// Like EVENTS, but with the count of every ticket category.
+// Counts are varints, so typical ones take 1-2 bytes and large venues fit.
+void write_event_categories(Database &db, NetworkWriter &writer) {
+    writer.add_number(EVENT_CATEGORIES);
+    for (auto it = db.events_begin(); it != db.events_end(); ++it) {
+        const uint8_t description_length = it->description.length();
+        std::size_t entry_length = 4 + 1 + 1 + description_length;
+        for (uint8_t category = 0; category < it->category_count; ++category)
+            entry_length += NetworkWriter::varint_length(db.available_tickets(it->event_id,
+                                                                              category));
+        if (writer.size() - writer.length() < entry_length)
+            break;
+        writer.add_number(it->event_id);
+        writer.add_number(it->category_count);
+        for (uint8_t category = 0; category < it->category_count; ++category)
+            writer.add_varint(db.available_tickets(it->event_id, category));
+        writer.add_number(description_length);
+        writer.write_to_buffer(it->description, description_length);
+    }
+}
+
+void write_reservation(NetworkWriter &writer, const Reservation &reservation) {
+    writer.add_number(RESERVATION);
+    writer.add_number(reservation.reservation_id);
+    writer.add_number(reservation.event_id);
+    writer.add_number(static_cast<uint16_t>(reservation.ticket_count));
+    writer.write_to_buffer(reservation.cookie, COOKIE_LEN);
+    writer.add_number(reservation.expiration_time);
+}
+
+void write_reservation(Database &db, NetworkWriter &writer,
+                       uint32_t event_id, uint16_t ticket_count, uint8_t category)
+{
+    try {
+        write_reservation(writer, db.make_reservation(event_id, ticket_count, category));
+    } catch (std::exception&) {
+        writer.add_number(BAD_REQUEST);
+        writer.add_number(event_id);
+    }
+}
+
+// Unlike write_reservation(), BAD_REQUEST echoes the 8-byte external ID
+// the client has sent, whatever the reason of the failure.
+void write_external_reservation(Database &db, NetworkWriter &writer, uint64_t external_id,
+                                uint16_t ticket_count, uint8_t category)
+{
+    try {
+        const uint32_t event_id = db.find_event(external_id);
+        write_reservation(writer, db.make_reservation(event_id, ticket_count, category));
+    } catch (std::exception&) {
+        writer.add_number(BAD_REQUEST);
+        writer.add_number(external_id);
+    }
+}
+
+// Same as RESERVATION, but with a 4-byte ticket count.
+void write_large_reservation(Database &db, NetworkWriter &writer,
+                             uint32_t event_id, uint32_t ticket_count, uint8_t category)
+{
+    try {
+        const Reservation reservation = db.make_large_reservation(event_id, ticket_count, category);
+        writer.add_number(LARGE_RESERVATION);
+        writer.add_number(reservation.reservation_id);
+        writer.add_number(reservation.event_id);
+        writer.add_number(reservation.ticket_count);
+        writer.write_to_buffer(reservation.cookie, COOKIE_LEN);
+        writer.add_number(reservation.expiration_time);
+    } catch (std::exception&) {
+        writer.add_number(BAD_REQUEST);
+        writer.add_number(event_id);
+    }
+}
+
+void write_ticket_chunk(Database &db, NetworkWriter &writer,
+                        uint32_t reservation_id, char const *cookie, uint32_t chunk)
+{
+    try {
+        const auto tickets = db.get_ticket_chunk(reservation_id, cookie, chunk);
+        writer.add_number(TICKET_CHUNK);
+        writer.add_number(reservation_id);
+        writer.add_number(chunk);
+        writer.add_number(static_cast<uint16_t>(tickets.size()));
+        for (const auto &ticket : tickets)
+            writer.write_to_buffer(ticket.code, TICKET_LEN);
+    } catch (std::exception&) {
+        writer.add_number(BAD_REQUEST);
+        writer.add_number(reservation_id);
+    }
+}
+
+void write_tickets(Database &db, NetworkWriter &writer,
+                   uint32_t reservation_id, char const *cookie)
+{
+    try {
+        const auto tickets = db.get_tickets(reservation_id, cookie);
+        writer.add_number(TICKETS);
+        writer.add_number(reservation_id);
+        writer.add_number(static_cast<uint16_t>(tickets.size()));
+        for (const auto &ticket : tickets)
+            writer.write_to_buffer(ticket.code, TICKET_LEN);
+    } catch (std::exception&) {
+        writer.add_number(BAD_REQUEST);
+        writer.add_number(reservation_id);
+    }
+}
+
+// Codes are expanded by the client: range i stands for tickets
+// first_i, first_i + 1, ..., first_i + count_i - 1 in base 36. Falls back
+// to TICKETS while codes are permuted.
+void write_ticket_ranges(Database &db, NetworkWriter &writer,
+                         uint32_t reservation_id, char const *cookie)
+{
+    try {
+        const auto ranges = db.get_ticket_ranges(reservation_id, cookie);
+        writer.add_number(TICKET_RANGES);
+        writer.add_number(reservation_id);
+        writer.add_number(static_cast<uint8_t>(ranges.size()));
+        for (const auto &range : ranges) {
+            writer.write_to_buffer(range.first.code, TICKET_LEN);
+            writer.add_number(range.count);
+        }
+    } catch (const TicketsNotConsecutive&) {
+        write_tickets(db, writer, reservation_id, cookie);
+    } catch (std::exception&) {
+        writer.add_number(BAD_REQUEST);
+        writer.add_number(reservation_id);
+    }
+}
+
+void write_search_result(Database &db, NetworkWriter &writer, std::string_view query) {
+    std::vector<uint32_t> event_ids;
+    const std::size_t match_count = db.search_events(query, MAX_SEARCH_RESULTS, event_ids);
+
+    writer.add_number(SEARCH_RESULT);
+    writer.add_number(static_cast<uint32_t>(match_count));
+    for (const uint32_t event_id : event_ids) {
+        writer.add_number(event_id);
+        writer.add_varint(db.available_tickets(event_id));
+    }
+}
+
+void write_waitlisted(Database &db, NetworkWriter &writer, uint64_t client,
+                      uint32_t event_id, uint16_t ticket_count, uint8_t category)
+{
+    try {
+        const std::size_t position = db.join_waitlist(client, event_id, ticket_count, category);
+        writer.add_number(WAITLISTED);
+        writer.add_number(event_id);
+        writer.add_number(static_cast<uint32_t>(position));
+    } catch (std::exception&) {
+        writer.add_number(BAD_REQUEST);
+        writer.add_number(event_id);
+    }
+}
+
+// Reservations made for waitlisted clients are pushed to them as
+// unsolicited RESERVATION messages, from the public socket whatever
+// request freed the tickets. `allocations` is only a buffer, kept between
+// calls, and so is `writer`.
+void send_allocations(Database &db, int socket_fd, std::vector<Allocation> &allocations,
+                      NetworkWriter &writer)
+{
+    db.take_allocations(allocations);
+    for (const auto &allocation : allocations) {
+        writer.clear();
+        write_reservation(writer, allocation.reservation);
+        try {
+            send_message(socket_fd, id_to_address(allocation.client),
+                         writer.data(), writer.length());
+        } catch (std::exception &e) {
+            std::cerr << e.what() << "\n";
+        }
+    }
+}
+
+// Descriptions of consecutive events starting with `first_event_id`,
+// as many as fit. Clients page through the catalog by asking for the
+// event after the last one received.
+void write_catalog(Database &db, NetworkWriter &writer, uint32_t first_event_id) {
+    uint32_t count = 0;
+    std::size_t length = CATALOG_HEADER_SIZE;
+    for (uint64_t event_id = first_event_id; event_id < db.event_count(); ++event_id) {
+        const std::size_t entry_length = 1 + db.get_event(event_id).description.length();
+        if (length + entry_length > writer.size())
+            break;
+        length += entry_length;
+        ++count;
+    }
+
+    writer.add_number(CATALOG);
+    writer.add_number(db.get_catalog_version());
+    writer.add_number(first_event_id);
+    writer.add_number(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        const std::string &description = db.get_event(first_event_id + i).description;
+        writer.add_number(static_cast<uint8_t>(description.length()));
+        writer.write_to_buffer(description);
+    }
+}
+
+// Varint counts (category 0) of consecutive events starting with
+// `first_event_id`. If `catalog_version` is not the current one, no counts
+// are sent and the client should fetch the catalog again.
+void write_counts(Database &db, NetworkWriter &writer,
+                  uint32_t catalog_version, uint32_t first_event_id)
+{
+    uint32_t count = 0;
+    if (catalog_version == db.get_catalog_version()) {
+        std::size_t length = CATALOG_HEADER_SIZE;
+        for (uint64_t event_id = first_event_id; event_id < db.event_count(); ++event_id) {
+            const std::size_t entry_length =
+                NetworkWriter::varint_length(db.available_tickets(event_id));
+            if (length + entry_length > writer.size())
+                break;
+            length += entry_length;
+            ++count;
+        }
+    }
+
+    writer.add_number(COUNTS);
+    writer.add_number(db.get_catalog_version());
+    writer.add_number(first_event_id);
+    writer.add_number(count);
+    for (uint32_t i = 0; i < count; ++i)
+        writer.add_varint(db.available_tickets(first_event_id + i));
+}
+
+// Only the events that exist are listed.
+void write_availability(Database &db, NetworkWriter &writer, NetworkReader &reader,
+                        uint8_t id_count)
+{
+    uint32_t event_ids[MAX_AVAILABILITY_IDS] = {};
+    uint32_t ticket_counts[MAX_AVAILABILITY_IDS];
+    for (uint8_t i = 0; i < id_count; ++i)
+        event_ids[i] = reader.read_number<uint32_t>();
+    for (uint8_t i = 0; i < id_count; ++i) {
+        if (event_loading(db, event_ids[i])) {
+            write_retry_later(db, writer);
+            return;
+        }
+    }
+    db.get_ticket_counts(event_ids, id_count, ticket_counts);
+
+    uint8_t found = 0;
+    for (uint8_t i = 0; i < id_count; ++i)
+        found += event_ids[i] < db.event_count();
+
+    writer.add_number(AVAILABILITY);
+    writer.add_number(found);
+    for (uint8_t i = 0; i < id_count; ++i) {
+        if (event_ids[i] >= db.event_count())
+            continue;
+        writer.add_number(event_ids[i]);
+        writer.add_varint(ticket_counts[i]);
+    }
+}
+
+// Lengths of the requests handle_request() accepts. The socket filter is
+// built from the same rules, so that it drops the others before they
+// reach it.
+const std::vector<MessageRule> &request_rules() {
+    static const std::vector<MessageRule> rules{
+        {GET_EVENTS, GET_EVENTS_SIZE, GET_EVENTS_SIZE + FIRST_EVENT_SIZE},
+        {GET_RESERVATION, GET_RESERVATION_SIZE, GET_RESERVATION_SIZE + CATEGORY_SIZE},
+        {GET_TICKETS, GET_TICKETS_SIZE, GET_TICKETS_SIZE + CAPABILITIES_SIZE},
+        {GET_RESERVATION_EXTERNAL, GET_RESERVATION_EXTERNAL_SIZE,
+         GET_RESERVATION_EXTERNAL_SIZE + CATEGORY_SIZE},
+        {GET_EVENT_CATEGORIES, GET_EVENT_CATEGORIES_SIZE},
+        {GET_LARGE_RESERVATION, GET_LARGE_RESERVATION_SIZE,
+         GET_LARGE_RESERVATION_SIZE + CATEGORY_SIZE},
+        {GET_TICKET_CHUNK, GET_TICKET_CHUNK_SIZE},
+        {WAITLIST, WAITLIST_SIZE, WAITLIST_SIZE + CATEGORY_SIZE},
+        {GET_AVAILABILITY, 2, 0, 4},
+        {GET_CATALOG, GET_CATALOG_SIZE},
+        {GET_COUNTS, GET_COUNTS_SIZE},
+        {CHECK_TICKET, CHECK_TICKET_SIZE},
+        {SEARCH, 2, 0, 1},
+        {SEARCH_EVENTS, 2, 0, 1},
+        {GET_TOKEN, GET_TOKEN_SIZE},
+    };
+    return rules;
+}
+
+// The message ID of a request, past the VERIFIED header if any.
+uint8_t request_type(char const *buffer, std::size_t length) noexcept {
+    const uint8_t message_id = buffer[0];
+    if (message_id == VERIFIED && length > VERIFIED_HEADER_SIZE)
+        return buffer[VERIFIED_HEADER_SIZE];
+    return message_id;
+}
+
+// Listings cost the most to build and send, ticket collections and
+// searches less, and the remaining requests (reservations, single
+// lookups) the least.
+uint32_t request_cost(char const *buffer, std::size_t length) noexcept {
+    switch (request_type(buffer, length)) {
+        case GET_EVENTS:
+        case GET_EVENT_CATEGORIES:
+        case SEARCH_EVENTS:
+        case GET_CATALOG:
+        case GET_COUNTS:
+            return MAX_REQUEST_COST;
+        case GET_TICKETS:
+        case GET_TICKET_CHUNK:
+        case GET_AVAILABILITY:
+        case SEARCH:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+// Requests that reserve or collect tickets. Only served to verified
+// addresses, so that spoofed ones cannot take tickets on behalf of
+// someone else.
+bool changes_state(uint8_t message_id) noexcept {
+    switch (message_id) {
+        case GET_RESERVATION:
+        case GET_RESERVATION_EXTERNAL:
+        case GET_LARGE_RESERVATION:
+        case GET_TICKETS:
+        case GET_TICKET_CHUNK:
+        case WAITLIST:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Replaces what `writer` holds. Requests shorter than TOKEN (of
+// `request_length` bytes) get nothing, see MAX_AMPLIFICATION.
+void send_token(const AddressToken &tokens, NetworkWriter &writer, std::size_t request_length,
+                int socket_fd, const sockaddr_in &client_address)
+{
+    writer.clear();
+    if (request_length < TOKEN_SIZE)
+        return;
+    writer.add_number(TOKEN);
+    writer.add_number(tokens.issue(address_to_id(client_address)));
+    send_message(socket_fd, client_address, writer.data(), writer.length());
+}
+
+// Requests not matching request_rules() are ignored, and so are those
+// only served on the partner port (`partner`) when received on the other.
+// Returns false for the ignored ones. Without `tokens`, every address
+// counts as verified. While reservations are still to be restored
+// (`restoring`), requests about them get RETRY_LATER.
+bool handle_request(Database &db, EventFragments &fragments, const AddressToken *tokens,
+                    ServeBuffers &buffers, char const *buffer, std::size_t length,
+                    int socket_fd, const sockaddr_in &client_address, bool partner,
+                    bool restoring)
+{
+    NetworkWriter &writer = buffers.writer;
+    std::vector<iovec> &listing = buffers.listing;
+    writer.clear();
+    listing.clear();
+
+    const uint64_t client = address_to_id(client_address);
+    const std::size_t request_length = length;
+    bool verified = !tokens;
+    if (length > VERIFIED_HEADER_SIZE && static_cast<uint8_t>(buffer[0]) == VERIFIED) {
+        NetworkReader header(buffer, VERIFIED_HEADER_SIZE);
+        header.read_number<uint8_t>();
+        const uint64_t token = header.read_number<uint64_t>();
+        verified = verified || tokens->validate(client, token);
+        buffer += VERIFIED_HEADER_SIZE;
+        length -= VERIFIED_HEADER_SIZE;
+    }
+
+    if (!matches_rules(request_rules(), buffer, length))
+        return false;
+
+    if (!verified && changes_state(static_cast<uint8_t>(buffer[0]))) {
+        try {
+            send_token(*tokens, writer, request_length, socket_fd, client_address);
+        } catch (std::exception &e) {
+            std::cerr << e.what() << "\n";
+        }
+        return true;
+    }
+
+    const uint8_t message_id = buffer[0];
+    if (restoring && (changes_state(message_id) || message_id == CHECK_TICKET)) {
+        write_retry_later(db, writer);
+        try {
+            send_message(socket_fd, client_address, writer.data(), writer.length());
+        } catch (std::exception &e) {
+            std::cerr << e.what() << "\n";
+        }
+        return true;
+    }
+
+    NetworkReader reader(buffer, length);
+
+    db.expire_reservations();
+
+    switch (reader.read_number<uint8_t>()) {
+        case GET_EVENTS: {
+            const uint32_t first_event_id = (length > GET_EVENTS_SIZE)
+                                            ? reader.read_number<uint32_t>() : 0;
+            // Listings run up to the last event, so a partial one would
+            // look complete (and so for GET_CATALOG and GET_COUNTS).
+            if (catalog_loading(db))
+                write_retry_later(db, writer);
+            else
+                gather_events(db, fragments, listing, first_event_id);
+            break;
+        }
+        case GET_RESERVATION: {
+            const uint32_t event_id = reader.read_number<uint32_t>();
+            const uint16_t ticket_count = reader.read_number<uint16_t>();
+            const uint8_t category = (length > GET_RESERVATION_SIZE)
+                                     ? reader.read_number<uint8_t>() : 0;
+            if (event_loading(db, event_id))
+                write_retry_later(db, writer);
+            else
+                write_reservation(db, writer, event_id, ticket_count, category);
+            break;
+        }
+        case GET_TICKETS: {
+            const uint32_t reservation_id = reader.read_number<uint32_t>();
+            const char *cookie = reader.read_view(COOKIE_LEN).data();
+            const uint8_t capabilities = (length > GET_TICKETS_SIZE)
+                                         ? reader.read_number<uint8_t>() : 0;
+            if (capabilities & CAPABILITY_TICKET_RANGES)
+                write_ticket_ranges(db, writer, reservation_id, cookie);
+            else
+                write_tickets(db, writer, reservation_id, cookie);
+            break;
+        }
+        case GET_RESERVATION_EXTERNAL: {
+            const uint64_t external_id = reader.read_number<uint64_t>();
+            const uint16_t ticket_count = reader.read_number<uint16_t>();
+            const uint8_t category = (length > GET_RESERVATION_EXTERNAL_SIZE)
+                                     ? reader.read_number<uint8_t>() : 0;
+            // External IDs are only looked up once the catalog is indexed.
+            if (catalog_loading(db)) {
+                write_retry_later(db, writer);
+                break;
+            }
+            write_external_reservation(db, writer, external_id, ticket_count, category);
+            break;
+        }
+        case GET_EVENT_CATEGORIES: {
+            // Lists every event, so a partial listing would look complete.
+            if (catalog_loading(db))
+                write_retry_later(db, writer);
+            else
+                write_event_categories(db, writer);
+            break;
+        }
+        case GET_LARGE_RESERVATION: {
+            const uint32_t event_id = reader.read_number<uint32_t>();
+            const uint32_t ticket_count = reader.read_number<uint32_t>();
+            const uint8_t category = (length > GET_LARGE_RESERVATION_SIZE)
+                                     ? reader.read_number<uint8_t>() : 0;
+            if (event_loading(db, event_id))
+                write_retry_later(db, writer);
+            else
+                write_large_reservation(db, writer, event_id, ticket_count, category);
+            break;
+        }
+        case GET_TICKET_CHUNK: {
+            const uint32_t reservation_id = reader.read_number<uint32_t>();
+            const char *cookie = reader.read_view(COOKIE_LEN).data();
+            const uint32_t chunk = reader.read_number<uint32_t>();
+            write_ticket_chunk(db, writer, reservation_id, cookie, chunk);
+            break;
+        }
+        case WAITLIST: {
+            const uint32_t event_id = reader.read_number<uint32_t>();
+            const uint16_t ticket_count = reader.read_number<uint16_t>();
+            const uint8_t category = (length > WAITLIST_SIZE) ? reader.read_number<uint8_t>() : 0;
+            if (event_loading(db, event_id))
+                write_retry_later(db, writer);
+            else
+                write_waitlisted(db, writer, client,
+                                 event_id, ticket_count, category);
+            break;
+        }
+        case GET_AVAILABILITY: {
+            const uint8_t id_count = reader.read_number<uint8_t>();
+            write_availability(db, writer, reader, id_count);
+            break;
+        }
+        case GET_CATALOG: {
+            const uint32_t first_event_id = reader.read_number<uint32_t>();
+            if (catalog_loading(db))
+                write_retry_later(db, writer);
+            else
+                write_catalog(db, writer, first_event_id);
+            break;
+        }
+        case GET_COUNTS: {
+            const uint32_t catalog_version = reader.read_number<uint32_t>();
+            const uint32_t first_event_id = reader.read_number<uint32_t>();
+            if (catalog_loading(db))
+                write_retry_later(db, writer);
+            else
+                write_counts(db, writer, catalog_version, first_event_id);
+            break;
+        }
+        case SEARCH: {
+            const uint8_t query_length = reader.read_number<uint8_t>();
+            if (query_length < TrigramIndex::MIN_QUERY_LENGTH)
+                return false;
+            const std::string_view query = reader.read_view(query_length);
+            if (catalog_loading(db))
+                write_retry_later(db, writer);
+            else
+                write_search_result(db, writer, query);
+            break;
+        }
+        case CHECK_TICKET: {
+            // Would let anyone guess codes at the rate of the public port.
+            if (!partner)
+                return false;
+            const std::string_view code = reader.read_view(TICKET_LEN);
+            writer.add_number(TICKET_STATUS);
+            writer.write_to_buffer(code.data(), TICKET_LEN);
+            writer.add_number(static_cast<uint8_t>(db.validate_ticket(code.data())));
+            break;
+        }
+        case SEARCH_EVENTS: {
+            const uint8_t query_length = reader.read_number<uint8_t>();
+            if (query_length < TrigramIndex::MIN_QUERY_LENGTH)
+                return false;
+            const std::string_view query = reader.read_view(query_length);
+            if (catalog_loading(db))
+                write_retry_later(db, writer);
+            else
+                gather_search_events(db, fragments, listing, query);
+            break;
+        }
+        case GET_TOKEN: {
+            if (!tokens)
+                return false;
+            writer.add_number(TOKEN);
+            writer.add_number(tokens->issue(client));
+            break;
+        }
+        default:
+            return false;
+    }
+
+    std::size_t reply_length = writer.length();
+    for (const iovec &part : listing)
+        reply_length += part.iov_len;
+
+    try {
+        if (!verified && reply_length > MAX_AMPLIFICATION * request_length) {
+            send_token(*tokens, writer, request_length, socket_fd, client_address);
+        } else if (!listing.empty()) {
+            send_message(socket_fd, client_address, listing.data(), listing.size());
+        }
+        else {
+            send_message(socket_fd, client_address, writer.data(), writer.length());
+        }
+    } catch (std::exception &e) {
+        std::cerr << e.what() << "\n";
+    }
+
+    return true;
+}
+
+// Handles a request the kernel received at `arrival_time` (see
+// MessageBatch::timestamp()), recording how long it waited and how long
+// it took to handle. Returns false for ignored requests.
+bool serve_request(Database &db, EventFragments &fragments, const AddressToken *tokens,
+                   RequestLatencies &latencies, SalesLedger *ledger,
+                   ServeBuffers &buffers, uint64_t arrival_time,
+                   char const *buffer, std::size_t length,
+                   int socket_fd, const sockaddr_in &client_address, bool partner,
+                   bool restoring)
+{
+    const uint64_t start_time = realtime_ns();
+    const bool handled = handle_request(db, fragments, tokens, buffers, buffer, length,
+                                        socket_fd, client_address, partner, restoring);
+    // Taken even without a ledger, so that they do not pile up.
+    db.take_sales(buffers.sales);
+    for (const Sale &sale : buffers.sales) {
+        if (ledger)
+            ledger->append(sale, address_to_id(client_address), sale.collection_time);
+    }
+    const uint64_t end_time = realtime_ns();
+    latencies.record(request_type(buffer, length),
+                     start_time > arrival_time ? start_time - arrival_time : 0,
+                     end_time - start_time);
+    return handled;
 }
 
 void run(const ServerParameters &parameters) {
-    char buffer[MAX_REQUEST_SIZE];
-    memset(buffer, 0, sizeof(buffer));
+    // Blocked before any export thread starts, so that neither of them
+    // gets the other's signal.
+    sigset_t export_signals;
+    sigemptyset(&export_signals);
+    sigaddset(&export_signals, PROFILE_EXPORT_SIGNAL);
+    sigaddset(&export_signals, METRICS_EXPORT_SIGNAL);
+    pthread_sigmask(SIG_BLOCK, &export_signals, nullptr);
+
+    if (parameters.profile_frequency) {
+        Profiler::export_on_signal(PROFILE_EXPORT_SIGNAL, PROFILE_EXPORT_PATH);
+        Profiler::start(parameters.profile_frequency);
+    }
 
+    const auto filter = build_socket_filter(request_rules(), MAX_REQUEST_SIZE,
+                                            VERIFIED, VERIFIED_HEADER_SIZE);
     int socket_fd = bind_socket(parameters.port);
-    struct sockaddr_in client_address;
-    std::size_t read_length;
+    attach_socket_filter(socket_fd, filter);
+    enable_timestamps(socket_fd);
+    // Box office and partner integrations get a port of their own, so that
+    // floods of the public one cannot delay them.
+    int partner_fd = -1;
+    if (parameters.partner_port) {
+        partner_fd = bind_socket(parameters.partner_port);
+        attach_socket_filter(partner_fd, filter);
+        enable_timestamps(partner_fd);
+    }
 
-    Database db = load_database(parameters);
+    MessageBatch batch(BATCH_SIZE, MAX_REQUEST_SIZE);
+    MessageBatch partner_batch(PARTNER_BUDGET, MAX_REQUEST_SIZE);
+    std::atomic<uint64_t> partner_requests{0};
+    std::atomic<uint64_t> malformed_requests{0};
+    BatchController controller(MIN_BATCH_SIZE, BATCH_SIZE, BATCH_INCREASE, POLL_LIMIT);
+    std::random_device random;
+    FairScheduler scheduler(SCHEDULER_SLOTS, MAX_REQUEST_SIZE, SCHEDULER_FLOWS,
+                            MAX_FLOW_LENGTH, MAX_REQUEST_COST,
+                            static_cast<uint64_t>(random()) << 32 | random());
+
+    // Datagrams the filter has dropped (along with those the receive
+    // buffers had no room for) are counted by the kernel, the requests
+    // handle_request() has ignored nonetheless by the loop.
+    Metrics metrics;
+    metrics.add("socket_drops", [socket_fd] { return socket_drops(socket_fd); });
+    if (partner_fd != -1)
+        metrics.add("partner_socket_drops", [partner_fd] { return socket_drops(partner_fd); });
+    metrics.add("malformed_requests", [&malformed_requests] {
+        return malformed_requests.load(std::memory_order_relaxed);
+    });
+    metrics.add("scheduler_drops", [&scheduler] { return scheduler.dropped(); });
+    metrics.add("partner_requests", [&partner_requests] {
+        return partner_requests.load(std::memory_order_relaxed);
+    });
+    metrics.add("batch_size", [&controller] { return controller.batch_size(); });
+    metrics.add("batch_polling", [&controller] { return controller.polling(); });
+    RequestLatencies latencies;
+    metrics.add([&latencies](std::ostream &out) { latencies.write(out); });
+    std::unique_ptr<SalesLedger> ledger;
+    if (!parameters.ledger_path.empty()) {
+        ledger = std::make_unique<SalesLedger>(parameters.ledger_path, LEDGER_FLUSH_INTERVAL);
+        metrics.add("ledger_rows_written", [&ledger] { return ledger->rows_written(); });
+        metrics.add("ledger_write_failures", [&ledger] { return ledger->write_failures(); });
+    }
+    std::unique_ptr<Checkpointer> checkpointer;
+    if (!parameters.checkpoint_path.empty()) {
+        checkpointer = std::make_unique<Checkpointer>(parameters.checkpoint_path,
+                                                      CHECKPOINT_INTERVAL,
+                                                      CHECKPOINT_MERGE_AFTER);
+        metrics.add("checkpoint_pages_written", [&checkpointer] {
+            return checkpointer->pages_written();
+        });
+        metrics.add("checkpoint_write_failures", [&checkpointer] {
+            return checkpointer->write_failures();
+        });
+    }
+    std::unique_ptr<MappedStore> store;
+    if (!parameters.store_path.empty()) {
+        store = std::make_unique<MappedStore>(parameters.store_path, STORE_COMMIT_INTERVAL);
+        metrics.add("store_commits", [&store] { return store->commits(); });
+        metrics.add("store_commit_failures", [&store] { return store->commit_failures(); });
+    }
+    metrics.export_on_signal(METRICS_EXPORT_SIGNAL, METRICS_EXPORT_PATH);
 
+    // Requests are served as soon as the first chunk of the catalog has
+    // been loaded, the rest is added between loop iterations. Restored
+    // state comes back along with the events it refers to: ticket counts
+    // with theirs, the counters right away and reservations once every
+    // event has been loaded. Pages still to be restored are kept until then.
+    const Clock &clock = SystemClock::instance();
+    Database db(parameters.timeout, clock, parameters.ticket_key);
+    CatalogLoader loader(parameters.filepath);
+    loader.integrate(db, true);
+    std::vector<StatePage> restored_pages;
+    std::size_t next_restored = 0;
+    if (checkpointer)
+        checkpointer->read_pages(restored_pages);
+    if (store)
+        store->read_pages(restored_pages);
+    restore_pages(db, restored_pages, next_restored);
+    if (parameters.ticket_key_given && db.get_ticket_key() != parameters.ticket_key)
+        throw std::runtime_error("The ticket key differs from the one of the restored state.");
+    EventFragments fragments;
+    fragments.extend(db);
+
+    std::unique_ptr<AddressToken> tokens;
+    if (parameters.verify_addresses) {
+        tokens = std::make_unique<AddressToken>(
+            static_cast<uint64_t>(random()) << 32 | random(),
+            static_cast<uint64_t>(random()) << 32 | random(),
+            clock);
+    }
+
+    // Every iteration serves at most as many requests as a batch holds,
+    // so that a backlog builds up in the scheduler (where clients are
+    // treated fairly) rather than in the socket. Partner requests bypass
+    // the scheduler: up to PARTNER_BUDGET of them are served at the start
+    // of every iteration. The loop only blocks when there is nothing to
+    // serve and the controller is not polling; while the catalog is
+    // loading, it also wakes up for every chunk, with a ledger or
+    // checkpoints every IDLE_WAKEUP_INTERVAL, and with a mapped store every
+    // STORE_COMMIT_INTERVAL. Negative descriptors are ignored by poll().
+    int wait_fds[] = {socket_fd, partner_fd, loader.ready_fd()};
+    const int wait_timeout = store ? static_cast<int>(STORE_COMMIT_INTERVAL)
+                           : ledger || checkpointer ? IDLE_WAKEUP_INTERVAL : -1;
+    FairScheduler::Request request;
+    ServeBuffers buffers;
+    std::vector<Allocation> allocations;
     while (true) {
-        read_length = read_message(socket_fd, client_address, buffer, sizeof(buffer));
-        if (!read_length)
-            std::cerr << "The server has received an empty message. Ignoring.\n";
-        else
-            handle_request(db, buffer, read_length, socket_fd, client_address);
+        if (!loader.loaded()) {
+            if (loader.integrate(db))
+                wait_fds[2] = -1;
+            fragments.extend(db);
+            restore_pages(db, restored_pages, next_restored);
+        }
+        const bool restoring = !restored_pages.empty();
+
+        const bool wait = scheduler.empty() && !controller.polling();
+        if (partner_fd == -1 && loader.loaded() && wait_timeout == -1) {
+            batch.receive(socket_fd, wait, controller.batch_size());
+        } else {
+            if (wait)
+                wait_for_messages(wait_fds, std::size(wait_fds), wait_timeout);
+            if (partner_fd != -1 && partner_batch.receive(partner_fd, false, PARTNER_BUDGET)) {
+                for (std::size_t i = 0; i < partner_batch.size(); ++i) {
+                    if (partner_batch.length(i)
+                        && !serve_request(db, fragments, tokens.get(), latencies, ledger.get(),
+                                          buffers, partner_batch.timestamp(i),
+                                          partner_batch.data(i),
+                                          partner_batch.length(i), partner_fd,
+                                          partner_batch.address(i), true, restoring))
+                    {
+                        malformed_requests.fetch_add(1, std::memory_order_relaxed);
+                    }
+                }
+                partner_requests.fetch_add(partner_batch.size(), std::memory_order_relaxed);
+            }
+            batch.receive(socket_fd, false, controller.batch_size());
+        }
+
+        for (std::size_t i = 0; i < batch.size(); ++i) {
+            if (!batch.length(i)) {
+                std::cerr << "The server has received an empty message. Ignoring.\n";
+                continue;
+            }
+            scheduler.push(address_to_id(batch.address(i)), batch.timestamp(i),
+                           batch.data(i), batch.length(i),
+                           request_cost(batch.data(i), batch.length(i)));
+        }
+
+        const std::size_t budget = controller.batch_size();
+        for (std::size_t served = 0; served < budget && scheduler.pop(request); ++served) {
+            if (!serve_request(db, fragments, tokens.get(), latencies, ledger.get(), buffers,
+                               request.arrival_time, request.data, request.length,
+                               socket_fd, id_to_address(request.client), false, restoring))
+            {
+                malformed_requests.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        // Sent here rather than per request, so that none is left behind
+        // by a request that expired reservations and was then ignored.
+        send_allocations(db, socket_fd, allocations, buffers.writer);
+        controller.update(batch.size(), scheduler.queued());
+        const uint64_t now = clock.now();
+        if (ledger)
+            ledger->flush_if_stale(now);
+        if (checkpointer)
+            checkpointer->checkpoint_if_stale(db, now);
+        if (store)
+            store->commit_if_stale(db, clock.now_ms());
     }
 
     close(socket_fd);
+    if (partner_fd != -1)
+        close(partner_fd);
 }
 
 int main(int argc, char *argv[]) {
     auto parameters = parse_parameters(argc - 1, &argv[1]);
-    run(parameters);
+    try {
+        run(parameters);
+    } catch (std::exception &e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
 
     return 0;
 }
@@ -0,0 +1,210 @@
+#include "trigram_index.h"
+
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+///////////////////////////
+///                     ///
+///      CONSTANTS      ///
+///                     ///
+///////////////////////////
+
+
+constexpr std::size_t MAX_LIST_RATIO = 32;
+
+
+///////////////////////////
+///                     ///
+///     AUXILIARY       ///
+///     FUNCTIONS       ///
+///                     ///
+///////////////////////////
+
+
+namespace {
+    uint8_t fold(char c) noexcept {
+        return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : static_cast<uint8_t>(c);
+    }
+
+    uint32_t trigram_at(std::string_view text, std::size_t position) noexcept {
+        return static_cast<uint32_t>(fold(text[position])) << 16
+               | static_cast<uint32_t>(fold(text[position + 1])) << 8
+               | fold(text[position + 2]);
+    }
+
+    void append_varint(std::vector<uint8_t> &bytes, uint32_t value) {
+        while (value >= 0x80) {
+            bytes.push_back(static_cast<uint8_t>(value) | 0x80);
+            value >>= 7;
+        }
+        bytes.push_back(static_cast<uint8_t>(value));
+    }
+
+    // Intersects two sorted lists of unique IDs. `out` may alias `a`.
+    std::size_t intersect(const uint32_t *a, std::size_t a_size,
+                          const uint32_t *b, std::size_t b_size,
+                          uint32_t *out) noexcept
+    {
+        std::size_t i = 0, j = 0, k = 0;
+#if defined(__SSE2__)
+        // Compare blocks of four against all four rotations of each other
+        // and advance the block with the smaller maximum.
+        while (i + 4 <= a_size && j + 4 <= b_size) {
+            const __m128i block_a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+            const __m128i block_b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + j));
+            __m128i equal = _mm_cmpeq_epi32(block_a, block_b);
+            equal = _mm_or_si128(equal, _mm_cmpeq_epi32(block_a,
+                                 _mm_shuffle_epi32(block_b, _MM_SHUFFLE(0, 3, 2, 1))));
+            equal = _mm_or_si128(equal, _mm_cmpeq_epi32(block_a,
+                                 _mm_shuffle_epi32(block_b, _MM_SHUFFLE(1, 0, 3, 2))));
+            equal = _mm_or_si128(equal, _mm_cmpeq_epi32(block_a,
+                                 _mm_shuffle_epi32(block_b, _MM_SHUFFLE(2, 1, 0, 3))));
+
+            int mask = _mm_movemask_ps(_mm_castsi128_ps(equal));
+            const uint32_t a_max = a[i + 3];
+            const uint32_t b_max = b[j + 3];
+            uint32_t matches[4];
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(matches), block_a);
+            for (int lane = 0; mask; ++lane, mask >>= 1)
+                if (mask & 1)
+                    out[k++] = matches[lane];
+
+            i += (a_max <= b_max) ? 4 : 0;
+            j += (b_max <= a_max) ? 4 : 0;
+        }
+#endif
+        while (i < a_size && j < b_size) {
+            if (a[i] < b[j]) {
+                ++i;
+            } else if (b[j] < a[i]) {
+                ++j;
+            } else {
+                out[k++] = a[i];
+                ++i;
+                ++j;
+            }
+        }
+        return k;
+    }
+}
+
+
+///////////////////////////
+///                     ///
+///    TRIGRAM INDEX    ///
+///                     ///
+///////////////////////////
+
+
+void TrigramIndex::build(const std::vector<std::string_view> &documents) {
+    m_pairs.clear();
+    m_added = 0;
+    for (const std::string_view document : documents)
+        add(document);
+    finish();
+}
+
+// Every document's (trigram, document) pairs are deduplicated as it is
+// added, so that repeated trigrams take no memory until finish().
+void TrigramIndex::add(std::string_view document) {
+    const std::size_t start = m_pairs.size();
+    for (std::size_t i = 0; i + 3 <= document.size(); ++i)
+        m_pairs.push_back(static_cast<uint64_t>(trigram_at(document, i)) << 32 | m_added);
+    std::sort(m_pairs.begin() + start, m_pairs.end());
+    m_pairs.erase(std::unique(m_pairs.begin() + start, m_pairs.end()), m_pairs.end());
+    ++m_added;
+}
+
+void TrigramIndex::finish() {
+    m_lists.clear();
+    m_postings.clear();
+
+    // Sorted by trigram and then by document.
+    std::vector<uint64_t> pairs;
+    pairs.swap(m_pairs);
+    m_added = 0;
+    std::sort(pairs.begin(), pairs.end());
+
+    uint32_t previous_id = 0;
+    for (const uint64_t pair : pairs) {
+        const uint32_t trigram = pair >> 32;
+        const uint32_t id = static_cast<uint32_t>(pair);
+        if (m_lists.empty() || m_lists.back().trigram != trigram) {
+            m_lists.push_back(PostingList{trigram, 0, static_cast<uint32_t>(m_postings.size())});
+            previous_id = 0;
+        }
+        append_varint(m_postings, id - previous_id);
+        previous_id = id;
+        ++m_lists.back().count;
+    }
+
+    m_lists.shrink_to_fit();
+    m_postings.shrink_to_fit();
+}
+
+void TrigramIndex::candidates(std::string_view query, std::vector<uint32_t> &result) const {
+    result.clear();
+    if (query.size() < MIN_QUERY_LENGTH)
+        return;
+
+    std::vector<const PostingList*> lists;
+    for (std::size_t i = 0; i + 3 <= query.size(); ++i) {
+        const PostingList *list = find(trigram_at(query, i));
+        if (!list)
+            return;
+        lists.push_back(list);
+    }
+    std::sort(lists.begin(), lists.end(), [](const PostingList *a, const PostingList *b) {
+        return a->count < b->count;
+    });
+    lists.erase(std::unique(lists.begin(), lists.end()), lists.end());
+
+    // Start from the shortest list, so that the intersection only shrinks.
+    // Once the remaining lists are much longer than the candidate set,
+    // decoding them costs more than verifying the candidates.
+    decode(*lists[0], result);
+    std::vector<uint32_t> other;
+    for (std::size_t i = 1; i < lists.size() && !result.empty(); ++i) {
+        if (lists[i]->count > MAX_LIST_RATIO * result.size())
+            break;
+        decode(*lists[i], other);
+        result.resize(intersect(result.data(), result.size(),
+                                other.data(), other.size(), result.data()));
+    }
+}
+
+bool TrigramIndex::contains(std::string_view document, std::string_view query) noexcept {
+    return std::search(document.begin(), document.end(), query.begin(), query.end(),
+                       [](char a, char b) { return fold(a) == fold(b); })
+           != document.end();
+}
+
+const TrigramIndex::PostingList *TrigramIndex::find(uint32_t trigram) const noexcept {
+    auto it = std::lower_bound(m_lists.begin(), m_lists.end(), trigram,
+                               [](const PostingList &list, uint32_t value) {
+                                   return list.trigram < value;
+                               });
+    return (it != m_lists.end() && it->trigram == trigram) ? &*it : nullptr;
+}
+
+void TrigramIndex::decode(const PostingList &list, std::vector<uint32_t> &result) const {
+    result.resize(list.count);
+    const uint8_t *bytes = &m_postings[list.offset];
+    uint32_t id = 0;
+    for (uint32_t i = 0; i < list.count; ++i) {
+        uint32_t delta = 0;
+        int shift = 0;
+        uint8_t byte;
+        do {
+            byte = *bytes++;
+            delta |= static_cast<uint32_t>(byte & 0x7f) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+        id += delta;
+        result[i] = id;
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef __TRIGRAM_INDEX_H__
+#define __TRIGRAM_INDEX_H__
+
+#include <cstdint>
+#include <cstdlib> // std::size_t
+#include <string_view>
+#include <vector>
+
+// Inverted index from (ASCII case-folded) trigrams to the IDs of the
+// documents containing them. Every posting list is stored as delta-encoded
+// varints in a single byte arena.
+//
+// candidates() only narrows a substring query down to the documents that
+// contain all of its trigrams; the caller has to verify the matches.
+class TrigramIndex {
+public:
+    static constexpr std::size_t MIN_QUERY_LENGTH = 3;
+
+private:
+    struct PostingList {
+        uint32_t trigram;
+        uint32_t count;
+        uint32_t offset; // in m_postings
+    };
+
+    std::vector<PostingList>    m_lists; // sorted by trigram
+    std::vector<uint8_t>        m_postings;
+    std::vector<uint64_t>       m_pairs; // of the documents added, see add()
+    uint32_t                    m_added = 0;
+
+public:
+    TrigramIndex() = default;
+    ~TrigramIndex() = default;
+
+    // Document IDs are positions in `documents`.
+    void build(const std::vector<std::string_view> &documents);
+
+    // Builds the index a document at a time instead, so that the documents
+    // need not be kept until the last one: add() them in the order of their
+    // IDs (starting with 0), then finish().
+    void add(std::string_view document);
+    void finish();
+
+    // Sorted IDs of documents that may contain `query`: a superset of
+    // those containing all its trigrams, pruned by the rarest ones.
+    // `query` has to be at least MIN_QUERY_LENGTH characters long.
+    void candidates(std::string_view query, std::vector<uint32_t> &result) const;
+
+    static bool contains(std::string_view document, std::string_view query) noexcept;
+
+private:
+    const PostingList *find(uint32_t trigram) const noexcept;
+    void decode(const PostingList &list, std::vector<uint32_t> &result) const;
+};
+
+#endif // __TRIGRAM_INDEX_H__